@@ -1,13 +1,39 @@
 #include <cstdio>
+#include <cstdlib>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
 #include <vector>
-#include <functional>
 #include <thread>
+#include <atomic>
+#include <memory>
+#include <span>
 #include <chrono>
 #include <csignal>
+#include <ctime>
+#include <cerrno>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <bit>
 
+#if !defined(BOARD_RP1) && !defined(MOCK_GPIO)
 #include <bcm_host.h>		/* required to use bcm_host_get_peripheral_address() */
-#include <fcntl.h>		/* required to use open(), close(), usleep() */
-#include <sys/mman.h>		/* required to use mmap(), munmap() */
+#endif
+#include <fcntl.h>		/* required to use open(), close() */
+#include <sys/mman.h>		/* required to use mmap(), munmap(), mlockall() */
+#include <pthread.h>		/* required to use pthread_setschedparam(), pthread_setaffinity_np() */
+#include <unistd.h>		/* required to use getopt(), read() */
+#include <sys/timerfd.h>		/* required to use timerfd_create(), timerfd_settime() */
+#include <sys/timex.h>		/* required to use adjtimex() */
+#include <sys/ioctl.h>		/* required to use ioctl() */
+#include <sys/socket.h>		/* required to use socket(), bind(), recv() */
+#include <sys/un.h>		/* required to use sockaddr_un */
+#include <sys/epoll.h>		/* required to use epoll_create1(), epoll_wait() */
+#include <sys/resource.h>		/* required to use getrusage() */
+#ifdef USE_GPIOD
+#include <gpiod.h>		/* required to use gpiod_chip_request_lines() */
+#endif
 
 using namespace std;
 using namespace std::chrono;
@@ -43,6 +69,11 @@ int GetFSELOffset(int id)
 	return -1;
 }
 
+void StoreRegister(uint32_t* dst, uint32_t value)
+{
+	*static_cast<volatile uint32_t*>(dst) = value;
+}
+
 void MaskedWrite(uint32_t* dst, uint32_t mask, uint32_t value)
 {
 	auto oldValue = *dst;
@@ -92,107 +123,155 @@ void WriteFSEL(void* map, int id, uint8_t func)
 	writer.Write(GetAddress(map, offset), func);
 }
 
-uint32_t* GetSetAddress(void* map, int id)
+enum EGPIOStore
 {
-	constexpr auto GPSET0 = 0x1C;
-	constexpr auto GPSET1 = 0x20;
-	if(0 <= id && id < 32)
-	{
-		return GetAddress(map, GPSET0);
-	}
-	else if(id < 54)
-	{
-		return GetAddress(map, GPSET1);
-	}
-	return nullptr;
-}
+	GPIOSet,
+	GPIOClear,
+	NumGPIOStores,
+};
 
-uint32_t* GetClearAddress(void* map, int id)
+struct SBcmBoard
 {
-	constexpr auto GPCLR0 = 0x28;
-	constexpr auto GPCLR1 = 0x2C;
-	if(0 <= id && id < 32)
-	{
-		return GetAddress(map, GPCLR0);
-	}
-	else if(id < 54)
-	{
-		return GetAddress(map, GPCLR1);
-	}
-	return nullptr;
-}
+	static constexpr int numBanks = 2;
+	static constexpr int bankStarts[numBanks] = { 0, 32 };
+	static constexpr int numPins = 54;
+	static constexpr size_t mapSize = 4096;
+	static constexpr const char* defaultDevice = "/dev/mem";
+
+	static off_t GetMapOffset(const char* device);
+	static constexpr uint32_t GetStoreOffset(EGPIOStore kind, int bank);
+	static void SetFunction(void* map, int id, uint8_t func);
+private:
+	static constexpr uint32_t GPSET0 = 0x1C;
+	static constexpr uint32_t GPCLR0 = 0x28;
+};
+
+struct SRp1Board
+{
+	static constexpr int numBanks = 3;
+	static constexpr int bankStarts[numBanks] = { 0, 28, 34 };
+	static constexpr int numPins = 54;
+	static constexpr size_t mapSize = 0x30000;
+	static constexpr const char* defaultDevice = "/dev/gpiomem0";
+
+	static off_t GetMapOffset(const char* device);
+	static constexpr uint32_t GetStoreOffset(EGPIOStore kind, int bank);
+	static void SetFunction(void* map, int id, uint8_t func);
+private:
+	static constexpr uint32_t ioBankOffset = 0x00000;
+	static constexpr uint32_t rioOffset = 0x10000;
+	static constexpr uint32_t padsOffset = 0x20000;
+	static constexpr uint32_t bankStride = 0x4000;
+	static constexpr uint32_t xorAlias = 0x1000;
+	static constexpr uint32_t setAlias = 0x2000;
+	static constexpr uint32_t clearAlias = 0x3000;
+	static constexpr uint32_t RIO_OUT = 0x00;
+	static constexpr uint32_t RIO_OE = 0x04;
+};
+
+#ifdef BOARD_RP1
+using SBoard = SRp1Board;
+#else
+using SBoard = SBcmBoard;
+#endif
+
+constexpr int numBanks = SBoard::numBanks;
 
-uint32_t GetSetClearValue(int id)
+constexpr int GetBank(int id)
 {
-	return 0b1 << (id % 32);
+	if(id < 0 || SBoard::numPins <= id)
+		return -1;
+	int ret = 0;
+	while(ret + 1 < numBanks && SBoard::bankStarts[ret + 1] <= id)
+		++ret;
+	return ret;
 }
 
-class CGPIO
+constexpr uint32_t GetSetClearValue(int id)
 {
-public:
-	explicit CGPIO(void* map, int id);
-	CGPIO(const CGPIO&) = delete;
-	CGPIO& operator =(const CGPIO&) = delete;
-	CGPIO(CGPIO&&);
-	CGPIO& operator =(CGPIO&&);
-	~CGPIO();
-	void Set();
-	void Clear();
-private:
-	static constexpr int errID = -1;
+	return 0b1u << (id - SBoard::bankStarts[max(GetBank(id), 0)]);
+}
 
-	void* const map;
-	const int id;
-	uint32_t* const setAddress;
-	uint32_t* const clearAddress;
-	const uint32_t setClearValue;
+struct SBankMasks
+{
+	uint32_t masks[numBanks];
 };
 
-CGPIO::CGPIO(void* map, int id)
-	: map{ map }, id{ id }
-	, setAddress { GetSetAddress(map, id) }
-	, clearAddress { GetClearAddress(map, id) }
-	, setClearValue { GetSetClearValue(id) }
+constexpr void AddToMasks(SBankMasks& masks, int id)
 {
-	WriteFSEL(map, id, 0b001);
+	auto bank = GetBank(id);
+	if(bank != -1)
+		masks.masks[bank] |= GetSetClearValue(id);
 }
 
-CGPIO::CGPIO(CGPIO&& a)
-	: map{ a.map }, id{ a.id }
-	, setAddress { a.setAddress }
-	, clearAddress { a.clearAddress }
-	, setClearValue { a.setClearValue }
+off_t SBcmBoard::GetMapOffset(const char* device)
 {
-	const_cast<int&>(a.id) = errID;
+#if defined(BOARD_RP1) || defined(MOCK_GPIO)
+	return 0;
+#else
+	constexpr off_t gpioOffset = 0x00200000;
+
+	if(string_view{ device } == "/dev/mem")
+		return static_cast<off_t>(bcm_host_get_peripheral_address()) + gpioOffset;
+	return 0;
+#endif
 }
 
-CGPIO& CGPIO::operator = (CGPIO&& a)
+constexpr uint32_t SBcmBoard::GetStoreOffset(EGPIOStore kind, int bank)
 {
-	if(&a == this)
-		return *this;
-	return *this = CGPIO(move(a));
+	return (kind == GPIOSet ? GPSET0 : GPCLR0) + static_cast<uint32_t>(bank) * sizeof(uint32_t);
 }
 
-CGPIO::~CGPIO()
+void SBcmBoard::SetFunction(void* map, int id, uint8_t func)
 {
-	if(id != errID)
-		WriteFSEL(map, id, 0b000);
+	WriteFSEL(map, id, func);
 }
 
-void CGPIO::Set()
+off_t SRp1Board::GetMapOffset(const char* device)
 {
-	*setAddress = setClearValue;
+	constexpr off_t rp1GPIOAddress = 0x1F000D0000;
+
+	if(string_view{ device } == "/dev/mem")
+		return rp1GPIOAddress;
+	return 0;
 }
 
-void CGPIO::Clear()
+constexpr uint32_t SRp1Board::GetStoreOffset(EGPIOStore kind, int bank)
 {
-	*clearAddress = setClearValue;
+	auto alias = kind == GPIOSet ? setAlias : clearAlias;
+	return rioOffset + static_cast<uint32_t>(bank) * bankStride + alias + RIO_OUT;
+}
+
+void SRp1Board::SetFunction(void* map, int id, uint8_t func)
+{
+	constexpr uint8_t funcOutput = 0b001;
+	constexpr uint32_t funcselMask = 0b11111;
+	constexpr uint32_t funcselSysRio = 5;
+	constexpr uint32_t padOutputDisable = 1 << 7;
+
+	auto bank = GetBank(id);
+	if(bank == -1)
+		return;
+	auto idx = static_cast<uint32_t>(id - bankStarts[bank]);
+	auto bit = GetSetClearValue(id);
+	auto rioOE = rioOffset + bank * bankStride + RIO_OE;
+	if(func != funcOutput)
+	{
+		StoreRegister(GetAddress(map, rioOE + clearAlias), bit);
+		return;
+	}
+	auto ctrl = ioBankOffset + bank * bankStride + idx * 8 + 4;
+	auto pad = padsOffset + bank * bankStride + 4 + idx * 4;
+	StoreRegister(GetAddress(map, ctrl + clearAlias), funcselMask);
+	StoreRegister(GetAddress(map, ctrl + setAlias), funcselSysRio);
+	StoreRegister(GetAddress(map, pad + clearAlias), padOutputDisable);
+	StoreRegister(GetAddress(map, rioOE + setAlias), bit);
 }
 
 class CMemFile
 {
 public:
-	explicit CMemFile();
+	explicit CMemFile(const char* path = "/dev/mem");
 	int GetFD() const noexcept { return fd; }
 	~CMemFile();
 
@@ -203,8 +282,8 @@ private:
 	const int fd;
 };
 
-CMemFile::CMemFile()
-	: fd{ open("/dev/mem", (O_RDWR | O_SYNC)) }
+CMemFile::CMemFile(const char* path)
+	: fd{ open(path, (O_RDWR | O_SYNC)) }
 {
 	if(fd == errFD)
 		throw OpenError{};
@@ -218,35 +297,47 @@ CMemFile::~CMemFile()
 class CMemMap
 {
 public:
-	explicit CMemMap();
+	static constexpr size_t block_size = 4096;
+
+#if !defined(BOARD_RP1) && !defined(MOCK_GPIO)
+	explicit CMemMap(off_t offset);
+#endif
+	explicit CMemMap(const char* path, off_t offset, size_t size = block_size);
 	void* Get() noexcept { return map; }
 	~CMemMap();
 
 	struct MapError{};
 private:
-	static constexpr size_t block_size = 4096;
-	static void* CreateMemMap();
+	static void* CreateMemMap(const char* path, off_t offset, size_t size);
 
+	const size_t size;
 	void* const map;
 };
 
-void* CMemMap::CreateMemMap()
+void* CMemMap::CreateMemMap(const char* path, off_t offset, size_t size)
 {
-	constexpr off_t gpio_offset = 0x00200000;
-
-	CMemFile memFile;
-	auto adr_gpio_base = bcm_host_get_peripheral_address();
+	if(!path)
+		return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	CMemFile memFile{ path };
 	auto map = mmap(NULL,
-	            block_size,
-	            PROT_WRITE,
+	            size,
+	            PROT_READ | PROT_WRITE,
 	            MAP_SHARED,
 	            memFile.GetFD(),
-	            adr_gpio_base + gpio_offset);
+	            offset);
 	return map;
 }
 
-CMemMap::CMemMap()
-	: map { CreateMemMap() }
+#if !defined(BOARD_RP1) && !defined(MOCK_GPIO)
+CMemMap::CMemMap(off_t offset)
+	: CMemMap{ "/dev/mem", static_cast<off_t>(bcm_host_get_peripheral_address()) + offset }
+{
+}
+#endif
+
+CMemMap::CMemMap(const char* path, off_t offset, size_t size)
+	: size{ size }
+	, map { CreateMemMap(path, offset, size) }
 {
 	if(map == MAP_FAILED)
 		throw MapError{};
@@ -254,270 +345,4746 @@ CMemMap::CMemMap()
 
 CMemMap::~CMemMap()
 {
-	munmap(map, block_size);
+	munmap(map, size);
 }
 
-void Pulse(CGPIO& gpio)
+void Increment(atomic<uint64_t>& counter) noexcept
 {
-	gpio.Set();
-	gpio.Clear();
+	counter.store(counter.load(memory_order_relaxed) + 1, memory_order_relaxed);
 }
 
-class CShiftRegister
+uint64_t GetRawTime() noexcept
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+	return static_cast<uint64_t>(t.tv_sec) * 1000000000 + static_cast<uint64_t>(t.tv_nsec);
+}
+
+enum ETraceKind : uint8_t
+{
+	TraceSet,
+	TraceClear,
+	TraceFunction,
+	NumTraceKinds,
+};
+
+// Store totals per kind for the profile export. Set/clear stores come from the refresh thread and FSEL writes from
+// setup, so each counter has a single writer.
+struct SStoreCounters
+{
+	atomic<uint64_t> counts[NumTraceKinds]{};
+
+	void Add(ETraceKind kind) noexcept { Increment(counts[kind]); }
+	void Add(EGPIOStore kind) noexcept { Add(kind == GPIOSet ? TraceSet : TraceClear); }
+};
+
+class CTraceRecorder
 {
 public:
-	explicit CShiftRegister(CMemMap& memMap, int siID, int rckID, int sckID);
-	~CShiftRegister();
-	void Write(uint8_t value);
-	void Flush();
+	explicit CTraceRecorder(const char* path, seconds duration);
+	CTraceRecorder(const CTraceRecorder&) = delete;
+	CTraceRecorder& operator =(const CTraceRecorder&) = delete;
+	~CTraceRecorder();
+	void Record(ETraceKind kind, int index, uint32_t value) noexcept;
+	void Record(EGPIOStore kind, int bank, uint32_t value) noexcept { Record(kind == GPIOSet ? TraceSet : TraceClear, bank, value); }
+
+	struct OpenError {};
 private:
-	CGPIO si;
-	CGPIO rck;
-	CGPIO sck;
+	struct SEntry
+	{
+		uint64_t time;
+		uint32_t value;
+		uint8_t kind;
+		uint8_t index;
+	};
+
+	static constexpr size_t capacity = 1 << 16;
+	static constexpr auto drainPeriod = milliseconds{ 50 };
+	static constexpr int8_t unknown = -1;
+
+	void WriterThread();
+	void WriteHeader();
+	void Drain();
+	void WriteLevel(uint64_t time, int id, int level);
+	void WriteFunction(uint64_t time, int id, uint32_t func);
+
+	FILE* const fp;
+	const unique_ptr<SEntry[]> entries;
+	const uint64_t stopTime;
+	atomic<uint64_t> head;
+	atomic<uint64_t> tail;
+	atomic<uint64_t> dropped;
+	atomic<bool> finished;
+	atomic<bool> capturing;
+	uint64_t startTime;
+	uint64_t lastTime;
+	int8_t levels[SBoard::numPins];
+	thread writer;
 };
 
-CShiftRegister::CShiftRegister(CMemMap& memMap, int siID, int rckID, int sckID)
-	: si{ memMap.Get(), siID }
-	, rck{ memMap.Get(), rckID }
-	, sck{ memMap.Get(), sckID }
+CTraceRecorder::CTraceRecorder(const char* path, seconds duration)
+	: fp{ fopen(path, "w") }
+	, entries{ make_unique<SEntry[]>(capacity) }
+	, stopTime{ GetRawTime() + static_cast<uint64_t>(duration_cast<nanoseconds>(duration).count()) }
+	, head{ 0 }, tail{ 0 }, dropped{ 0 }, finished{ false }, capturing{ true }
+	, startTime{ 0 }, lastTime{ ~uint64_t{ 0 } }
 {
+	if(!fp)
+		throw OpenError{};
+	fill(begin(levels), end(levels), unknown);
+	WriteHeader();
+	writer = thread{ &CTraceRecorder::WriterThread, this };
 }
 
-void CShiftRegister::Write(uint8_t value)
+CTraceRecorder::~CTraceRecorder()
 {
-	for(int i = 0; i < 8; ++i)
+	finished.store(true, memory_order_relaxed);
+	writer.join();
+	fprintf(fp, "$comment dropped %llu $end\n", static_cast<unsigned long long>(dropped.load(memory_order_relaxed)));
+	fclose(fp);
+}
+
+void CTraceRecorder::Record(ETraceKind kind, int index, uint32_t value) noexcept
+{
+	// Once the window has passed, the writer clears capturing, so later stores skip the clock read.
+	if(!capturing.load(memory_order_relaxed))
+		return;
+	auto now = GetRawTime();
+	if(stopTime <= now)
+		return;
+	auto h = head.load(memory_order_relaxed);
+	if(h - tail.load(memory_order_acquire) >= capacity)
 	{
-		auto lsb = value & 0b1;
-		if(lsb)
-			si.Set();
-		else
-			si.Clear();
-		Pulse(sck);
-		value = static_cast<uint8_t>(value >> 1);
+		Increment(dropped);
+		return;
 	}
+	entries[h % capacity] = SEntry{ now, value, kind, static_cast<uint8_t>(index) };
+	head.store(h + 1, memory_order_release);
 }
 
-void CShiftRegister::Flush()
+// Where a port reports its stores. Either side may be absent, and both expect a single writer per store kind.
+struct SStoreObserver
 {
-	Pulse(rck);
+	CTraceRecorder* recorder;
+	SStoreCounters* counters;
+
+	void OnFunction(int id, uint8_t func) const noexcept;
+	void OnStore(EGPIOStore kind, int bank, uint32_t value) const noexcept;
+};
+
+void SStoreObserver::OnFunction(int id, uint8_t func) const noexcept
+{
+	if(recorder)
+		recorder->Record(TraceFunction, id, func);
+	if(counters)
+		counters->Add(TraceFunction);
 }
 
-CShiftRegister::~CShiftRegister()
+void SStoreObserver::OnStore(EGPIOStore kind, int bank, uint32_t value) const noexcept
 {
-	Write(0b11111111);
+	if(recorder)
+		recorder->Record(kind, bank, value);
+	if(counters)
+		counters->Add(kind);
 }
 
-uint8_t Get7SegBits(int value)
+void CTraceRecorder::WriteHeader()
 {
-	switch(value)
+	fprintf(fp, "$timescale 1ns $end\n$scope module gpio $end\n");
+	for(int i = 0; i < SBoard::numPins; ++i)
 	{
-	case 0x0: return 0b00000011;
-	case 0x1: return 0b10011111;
-	case 0x2: return 0b00100101;
-	case 0x3: return 0b00001101;
-	case 0x4: return 0b10011001;
-	case 0x5: return 0b01001001;
-	case 0x6: return 0b01000001;
-	case 0x7: return 0b00011111;
-	case 0x8: return 0b00000001;
-	case 0x9: return 0b00001001;
-	case 0xA: return 0b00010001;
-	case 0xB: return 0b11000001;
-	case 0xC: return 0b01100011;
-	case 0xD: return 0b10000101;
-	case 0xE: return 0b01100001;
-	case 0xF: return 0b01110001;
-	default: return 0b11111111;
+		fprintf(fp, "$var wire 1 l%d gpio%d $end\n", i, i);
+		fprintf(fp, "$var reg 8 f%d func%d $end\n", i, i);
 	}
+	fprintf(fp, "$upscope $end\n$enddefinitions $end\n");
+}
+
+void CTraceRecorder::WriteLevel(uint64_t time, int id, int level)
+{
+	if(id >= SBoard::numPins || levels[id] == level)
+		return;
+	if(time != lastTime)
+		fprintf(fp, "#%llu\n", static_cast<unsigned long long>(time));
+	lastTime = time;
+	levels[id] = static_cast<int8_t>(level);
+	fprintf(fp, "%dl%d\n", level, id);
 }
 
-uint8_t Get7SegBitsWithPoint(int value, bool hasPoint)
+void CTraceRecorder::WriteFunction(uint64_t time, int id, uint32_t func)
 {
-	return static_cast<uint8_t>(Get7SegBits(value) & (hasPoint ? 0b11111110 : 0b11111111));
+	if(time != lastTime)
+		fprintf(fp, "#%llu\n", static_cast<unsigned long long>(time));
+	lastTime = time;
+	fprintf(fp, "b");
+	for(int i = 7; i >= 0; --i)
+		fputc((func >> i) & 0b1 ? '1' : '0', fp);
+	fprintf(fp, " f%d\n", id);
 }
 
-class C4Digits
+void CTraceRecorder::Drain()
+{
+	auto h = head.load(memory_order_acquire);
+	for(auto t = tail.load(memory_order_relaxed); t != h; ++t)
+	{
+		auto entry = entries[t % capacity];
+		if(startTime == 0)
+			startTime = entry.time;
+		auto time = entry.time - startTime;
+		if(entry.kind == TraceFunction)
+			WriteFunction(time, entry.index, entry.value);
+		else
+		{
+			for(int i = 0; i < 32; ++i)
+			{
+				if(entry.value & (0b1u << i))
+					WriteLevel(time, SBoard::bankStarts[entry.index] + i, entry.kind == TraceSet ? 1 : 0);
+			}
+		}
+		tail.store(t + 1, memory_order_release);
+	}
+}
+
+void CTraceRecorder::WriterThread()
+{
+	auto isCapturing = true;
+	while(!finished.load(memory_order_relaxed) && isCapturing)
+	{
+		isCapturing = GetRawTime() < stopTime;
+		this_thread::sleep_for(drainPeriod);
+		Drain();
+	}
+	capturing.store(false, memory_order_relaxed);
+	Drain();
+}
+
+class CMemPort
 {
 public:
-	explicit C4Digits(CMemMap& memMap, int id1, int id2, int id3, int id4);
-	void Switch(function<void(int)> write, function<void()> flush);
-	~C4Digits();
-private:
-	static constexpr int numDigits = 4;
+	struct SStore
+	{
+		uint32_t* address;
+		uint32_t value;
+		EGPIOStore kind;
+		int bank;
+	};
 
-	void Clear();
+	static constexpr const char* defaultDevice = SBoard::defaultDevice;
 
-	vector<CGPIO> digits;
-	int curDigitIdx;
+	explicit CMemPort(const char* device, const SStoreObserver& observer);
+	void SetFunction(int id, uint8_t func);
+	void SetObserver(const SStoreObserver& observer) noexcept { this->observer = observer; }
+	SStore MakeStore(EGPIOStore kind, int bank, uint32_t value) noexcept;
+	void Apply(const SStore& store) noexcept;
+	void Store(EGPIOStore kind, int bank, uint32_t value) noexcept;
+	template<EGPIOStore kind, int bank>
+	void Store(uint32_t value) noexcept;
+private:
+	CMemMap map;
+	uint32_t* addresses[NumGPIOStores][numBanks];
+	SStoreObserver observer;
 };
 
-C4Digits::C4Digits(CMemMap& memMap, int id1, int id2, int id3, int id4)
-	: curDigitIdx{ numDigits - 1 }
+CMemPort::CMemPort(const char* device, const SStoreObserver& observer)
+	: map{ device, SBoard::GetMapOffset(device), SBoard::mapSize }
+	, observer{ observer }
 {
-	digits.emplace_back(memMap.Get(), id1);
-	digits.emplace_back(memMap.Get(), id2);
-	digits.emplace_back(memMap.Get(), id3);
-	digits.emplace_back(memMap.Get(), id4);
-	Clear();
+	for(int i = 0; i < NumGPIOStores; ++i)
+	{
+		for(int j = 0; j < numBanks; ++j)
+			addresses[i][j] = GetAddress(map.Get(), SBoard::GetStoreOffset(static_cast<EGPIOStore>(i), j));
+	}
 }
 
-void C4Digits::Switch(function<void(int)> write, function<void()> flush)
+void CMemPort::SetFunction(int id, uint8_t func)
 {
-	auto lastDigitIdx = curDigitIdx;
-	curDigitIdx = (curDigitIdx + 1) % numDigits;
+	observer.OnFunction(id, func);
+	SBoard::SetFunction(map.Get(), id, func);
+}
 
-	write(curDigitIdx);
-	digits[lastDigitIdx].Clear();
-	flush();
-	digits[curDigitIdx].Set();
+void CMemPort::Apply(const SStore& store) noexcept
+{
+	if(!store.address)
+		return;
+	observer.OnStore(store.kind, store.bank, store.value);
+	StoreRegister(store.address, store.value);
 }
 
-void C4Digits::Clear()
+void CMemPort::Store(EGPIOStore kind, int bank, uint32_t value) noexcept
 {
-	for(auto& x : digits)
-		x.Clear();
+	observer.OnStore(kind, bank, value);
+	StoreRegister(addresses[kind][bank], value);
 }
 
-C4Digits::~C4Digits()
+template<EGPIOStore kind, int bank>
+void CMemPort::Store(uint32_t value) noexcept
 {
-	Clear();
+	observer.OnStore(kind, bank, value);
+	StoreRegister(GetAddress(map.Get(), SBoard::GetStoreOffset(kind, bank)), value);
 }
 
-int GetDigit(uint16_t value4, int digitIdx)
+CMemPort::SStore CMemPort::MakeStore(EGPIOStore kind, int bank, uint32_t value) noexcept
 {
-	return (value4 >> ((3 - digitIdx) * 4)) & 0b1111;
+	if(bank < 0 || numBanks <= bank)
+		return SStore{ nullptr, value, kind, bank };
+	return SStore{ addresses[kind][bank], value, kind, bank };
 }
 
-struct SMyValue
+#ifdef USE_GPIOD
+class CGpiodPort
 {
-	uint16_t value4;
-	bool point;
+public:
+	struct SStore
+	{
+		EGPIOStore kind;
+		int bank;
+		uint32_t value;
+	};
+
+	static constexpr const char* defaultDevice = "/dev/gpiochip0";
+
+	explicit CGpiodPort(const char* device, const SStoreObserver& observer);
+	void SetObserver(const SStoreObserver& observer) noexcept { this->observer = observer; }
+	CGpiodPort(const CGpiodPort&) = delete;
+	CGpiodPort& operator =(const CGpiodPort&) = delete;
+	~CGpiodPort();
+	void SetFunction(int id, uint8_t func);
+	SStore MakeStore(EGPIOStore kind, int bank, uint32_t value) noexcept { return SStore{ kind, bank, value }; }
+	void Apply(const SStore& store) noexcept { Store(store.kind, store.bank, store.value); }
+	void Store(EGPIOStore kind, int bank, uint32_t value) noexcept;
+	template<EGPIOStore kind, int bank>
+	void Store(uint32_t value) noexcept { Store(kind, bank, value); }
+
+	struct OpenError {};
+	struct RequestError {};
+private:
+	void Request();
+
+	gpiod_chip* const chip;
+	gpiod_line_request* request;
+	vector<unsigned int> lines;
+	SStoreObserver observer;
 };
 
-struct SSharedValues
+CGpiodPort::CGpiodPort(const char* device, const SStoreObserver& observer)
+	: chip{ gpiod_chip_open(device) }
+	, request{ nullptr }
+	, observer{ observer }
 {
-	CShiftRegister& reg;
-	const SMyValue& value;
-	C4Digits& digits;
-};
+	if(!chip)
+		throw OpenError{};
+}
+
+CGpiodPort::~CGpiodPort()
+{
+	if(request)
+		gpiod_line_request_release(request);
+	gpiod_chip_close(chip);
+}
 
-void DispThread(const bool* pFinished, const SSharedValues* pSharedValues)
+void CGpiodPort::SetFunction(int id, uint8_t func)
 {
-	auto& finished = *pFinished;
-	auto& reg = pSharedValues->reg;
-	auto& value = pSharedValues->value;
-	auto& digits = pSharedValues->digits;
+	constexpr uint8_t funcOutput = 0b001;
+
+	observer.OnFunction(id, func);
+	auto line = static_cast<unsigned int>(id);
+	auto it = find(lines.begin(), lines.end(), line);
+	if(func == funcOutput && it == lines.end())
+		lines.push_back(line);
+	else if(func != funcOutput && it != lines.end())
+		lines.erase(it);
+	else
+		return;
+	Request();
+}
 
-	auto write = [&reg, &value] (int curDigitIdx)
+void CGpiodPort::Request()
+{
+	if(request)
 	{
-		reg.Write(Get7SegBitsWithPoint(GetDigit(value.value4, curDigitIdx), (curDigitIdx == 1 && value.point)));
-	};
-	auto flush = [&reg] ()
+		gpiod_line_request_release(request);
+		request = nullptr;
+	}
+	if(lines.empty())
+		return;
+
+	auto settings = gpiod_line_settings_new();
+	auto lineConfig = gpiod_line_config_new();
+	auto requestConfig = gpiod_request_config_new();
+	if(settings && lineConfig && requestConfig)
 	{
-		reg.Flush();
-	};
-	while(!finished)
+		gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_OUTPUT);
+		gpiod_line_settings_set_output_value(settings, GPIOD_LINE_VALUE_INACTIVE);
+		gpiod_request_config_set_consumer(requestConfig, "clock-driver");
+		if(gpiod_line_config_add_line_settings(lineConfig, lines.data(), lines.size(), settings) == 0)
+			request = gpiod_chip_request_lines(chip, requestConfig, lineConfig);
+	}
+	gpiod_request_config_free(requestConfig);
+	gpiod_line_config_free(lineConfig);
+	gpiod_line_settings_free(settings);
+	if(!request)
+		throw RequestError{};
+}
+
+void CGpiodPort::Store(EGPIOStore kind, int bank, uint32_t value) noexcept
+{
+	observer.OnStore(kind, bank, value);
+	unsigned int offsets[32];
+	gpiod_line_value values[32];
+	auto lineValue = kind == GPIOSet ? GPIOD_LINE_VALUE_ACTIVE : GPIOD_LINE_VALUE_INACTIVE;
+	size_t n = 0;
+	for(int i = 0; i < 32; ++i)
 	{
-		digits.Switch(write, flush);
-		usleep(5000);
+		if(value & (0b1u << i))
+		{
+			offsets[n] = static_cast<unsigned int>(SBoard::bankStarts[bank] + i);
+			values[n] = lineValue;
+			++n;
+		}
 	}
+	if(n != 0)
+		gpiod_line_request_set_values_subset(request, n, offsets, values);
 }
 
-class CDispThread
+using CGPIOPort = CGpiodPort;
+#elif defined(MOCK_GPIO)
+class CMockPort
 {
 public:
-	CDispThread(const SSharedValues* pSharedValues);
-	~CDispThread();
+	struct SStore
+	{
+		EGPIOStore kind;
+		int bank;
+		uint32_t value;
+	};
+
+	static constexpr const char* defaultDevice = "mock";
+
+	explicit CMockPort(const char* device, const SStoreObserver& observer);
+	void SetFunction(int id, uint8_t func);
+	void SetObserver(const SStoreObserver& observer) noexcept { this->observer = observer; }
+	SStore MakeStore(EGPIOStore kind, int bank, uint32_t value) noexcept { return SStore{ kind, bank, value }; }
+	void Apply(const SStore& store) noexcept { Store(store.kind, store.bank, store.value); }
+	void Store(EGPIOStore kind, int bank, uint32_t value) noexcept;
+	template<EGPIOStore kind, int bank>
+	void Store(uint32_t value) noexcept { Store(kind, bank, value); }
+	void StartTrace(size_t capacity);
+	span<const SStore> StopTrace() noexcept;
+	uint64_t GetNumStores() const noexcept { return numStores; }
 private:
-	thread th;
-	bool finished;
+	CMemMap map;
+	uint32_t* addresses[NumGPIOStores][numBanks];
+	uint64_t numStores;
+	bool tracing;
+	vector<SStore> trace;
+	SStoreObserver observer;
 };
 
-CDispThread::CDispThread(const SSharedValues* pSharedValues)
-	: th{ DispThread, &finished, pSharedValues }, finished{ false }
+CMockPort::CMockPort(const char* device, const SStoreObserver& observer)
+	: map{ nullptr, 0, SBoard::mapSize }
+	, numStores{ 0 }, tracing{ false }, observer{ observer }
 {
+	for(int i = 0; i < NumGPIOStores; ++i)
+	{
+		for(int j = 0; j < numBanks; ++j)
+			addresses[i][j] = GetAddress(map.Get(), SBoard::GetStoreOffset(static_cast<EGPIOStore>(i), j));
+	}
 }
 
-CDispThread::~CDispThread()
+void CMockPort::SetFunction(int id, uint8_t func)
 {
-	finished = true;
-	th.join();
+	observer.OnFunction(id, func);
+	SBoard::SetFunction(map.Get(), id, func);
 }
 
-uint16_t CreateValue4(uint8_t digit12, uint8_t digit34)
+void CMockPort::Store(EGPIOStore kind, int bank, uint32_t value) noexcept
 {
-	return static_cast<uint16_t>((digit12 << 8) | digit34);
+	if(bank < 0 || numBanks <= bank)
+		return;
+	observer.OnStore(kind, bank, value);
+	StoreRegister(addresses[kind][bank], value);
+	++numStores;
+	if(tracing && trace.size() < trace.capacity())
+		trace.push_back(SStore{ kind, bank, value });
 }
 
-uint8_t CreateValue2(int value)
+void CMockPort::StartTrace(size_t capacity)
 {
-	return static_cast<uint8_t>(((value / 10) << 4) | (value % 10));
+	trace.clear();
+	trace.reserve(capacity);
+	tracing = true;
 }
 
-static volatile sig_atomic_t g_finished = 0;
-
-void SigHandler(int sig)
+span<const CMockPort::SStore> CMockPort::StopTrace() noexcept
 {
-	g_finished = 1;
+	tracing = false;
+	return trace;
 }
 
-struct SetSigHandlerFailed { int sig; };
+using CGPIOPort = CMockPort;
+#else
+using CGPIOPort = CMemPort;
+#endif
 
-void SetSigHandler(int sig)
+class CGPIO
 {
-	if (signal(sig, SigHandler) == SIG_ERR)
-		throw SetSigHandlerFailed{ sig };
+public:
+	explicit CGPIO(CGPIOPort& port, int id);
+	CGPIO(const CGPIO&) = delete;
+	CGPIO& operator =(const CGPIO&) = delete;
+	CGPIO(CGPIO&&);
+	CGPIO& operator =(CGPIO&&);
+	~CGPIO();
+	void Set();
+	void Clear();
+private:
+	static constexpr int errID = -1;
+
+	CGPIOPort& port;
+	const int id;
+	const CGPIOPort::SStore setStore;
+	const CGPIOPort::SStore clearStore;
+};
+
+CGPIO::CGPIO(CGPIOPort& port, int id)
+	: port{ port }, id{ id }
+	, setStore { port.MakeStore(GPIOSet, GetBank(id), GetSetClearValue(id)) }
+	, clearStore { port.MakeStore(GPIOClear, GetBank(id), GetSetClearValue(id)) }
+{
+	port.SetFunction(id, 0b001);
 }
 
-void SetTimeZone()
+CGPIO::CGPIO(CGPIO&& a)
+	: port{ a.port }, id{ a.id }
+	, setStore { a.setStore }
+	, clearStore { a.clearStore }
 {
-	static char envStr[] = "TZ=Asia/Tokyo";
-	putenv(envStr);
-	tzset();
+	const_cast<int&>(a.id) = errID;
 }
 
-SMyValue GetMyValue()
+CGPIO& CGPIO::operator = (CGPIO&& a)
 {
-	auto now = system_clock::now();
-	auto nowTime = system_clock::to_time_t(now);
-	auto pTime = localtime(&nowTime);
-	auto hour = pTime->tm_hour;
-	auto min = pTime->tm_min;
-	auto sec = pTime->tm_sec;
-	return SMyValue
-	{
-		CreateValue4(CreateValue2(hour), CreateValue2(min)),
-		(sec % 2) != 0,
-	};
+	if(&a == this)
+		return *this;
+	return *this = CGPIO(move(a));
 }
 
-int main()
+CGPIO::~CGPIO()
 {
-	try
-	{
-		SetSigHandler(SIGINT);
-		SetSigHandler(SIGTERM);
-		SetTimeZone();
+	if(id != errID)
+		port.SetFunction(id, 0b000);
+}
 
-		CMemMap memMap;
-		CShiftRegister reg{ memMap, 21, 20, 16 };
-		C4Digits digits{ memMap, 26, 19, 13, 6  };
-		auto value = GetMyValue();
-		auto sharedValues = SSharedValues{ reg, value, digits };
-		CDispThread th{ &sharedValues };
-		while(!g_finished)
+void CGPIO::Set()
+{
+	port.Apply(setStore);
+}
+
+void CGPIO::Clear()
+{
+	port.Apply(clearStore);
+}
+
+template<int... IDs>
+struct SPinSet
+{
+	static constexpr SBankMasks masks = [] { SBankMasks ret{}; (AddToMasks(ret, IDs), ...); return ret; }();
+
+	template<EGPIOStore kind>
+	static void Store(CGPIOPort& port) noexcept { StoreBanks<kind>(port, make_integer_sequence<int, numBanks>{}); }
+private:
+	static_assert(((GetBank(IDs) != -1) && ...));
+
+	template<EGPIOStore kind, int... banks>
+	static void StoreBanks(CGPIOPort& port, integer_sequence<int, banks...>) noexcept;
+};
+
+template<int... IDs>
+template<EGPIOStore kind, int... banks>
+void SPinSet<IDs...>::StoreBanks(CGPIOPort& port, integer_sequence<int, banks...>) noexcept
+{
+	auto store = [&port] <int bank> ()
+	{
+		if constexpr(masks.masks[bank] != 0)
+			port.template Store<kind, bank>(masks.masks[bank]);
+	};
+	(store.template operator()<banks>(), ...);
+}
+
+template<int ID>
+class CPin
+{
+public:
+	explicit CPin(CGPIOPort& port);
+	CPin(const CPin&) = delete;
+	CPin& operator =(const CPin&) = delete;
+	~CPin();
+	void Set() noexcept { SPinSet<ID>::template Store<GPIOSet>(port); }
+	void Clear() noexcept { SPinSet<ID>::template Store<GPIOClear>(port); }
+private:
+	CGPIOPort& port;
+};
+
+template<int ID>
+CPin<ID>::CPin(CGPIOPort& port)
+	: port{ port }
+{
+	port.SetFunction(ID, 0b001);
+}
+
+template<int ID>
+CPin<ID>::~CPin()
+{
+	port.SetFunction(ID, 0b000);
+}
+
+struct SPinTimingNs
+{
+	uint32_t high;
+	uint32_t low;
+	uint32_t setup;
+	uint32_t blank;
+
+	bool operator ==(const SPinTimingNs&) const = default;
+};
+
+class CPinTiming
+{
+public:
+	explicit CPinTiming();
+	void Configure(const SPinTimingNs& timing) noexcept;
+	void WaitBeforeEdge() noexcept;
+	void WaitHigh() noexcept;
+	void WaitBlank() noexcept;
+	uint32_t GetBlankNs() const noexcept { return timing.blank; }
+private:
+	static uint64_t SpinUntil(uint64_t t) noexcept;
+
+	SPinTimingNs timing;
+	bool enabled;
+	uint64_t fallTime;
+};
+
+static CPinTiming g_pinTiming;
+
+CPinTiming::CPinTiming()
+	: timing{}, enabled{ false }, fallTime{ 0 }
+{
+}
+
+void CPinTiming::Configure(const SPinTimingNs& timing) noexcept
+{
+	this->timing = timing;
+	enabled = timing.high != 0 || timing.low != 0 || timing.setup != 0;
+}
+
+uint64_t CPinTiming::SpinUntil(uint64_t t) noexcept
+{
+	auto now = GetRawTime();
+	while(now < t)
+		now = GetRawTime();
+	return now;
+}
+
+void CPinTiming::WaitBeforeEdge() noexcept
+{
+	if(enabled)
+		SpinUntil(max(fallTime + timing.low, GetRawTime() + timing.setup));
+}
+
+void CPinTiming::WaitHigh() noexcept
+{
+	if(enabled)
+		fallTime = SpinUntil(GetRawTime() + timing.high);
+}
+
+void CPinTiming::WaitBlank() noexcept
+{
+	if(timing.blank != 0)
+		SpinUntil(GetRawTime() + timing.blank);
+}
+
+template<int ID>
+void Pulse(CPin<ID>& pin)
+{
+	g_pinTiming.WaitBeforeEdge();
+	pin.Set();
+	g_pinTiming.WaitHigh();
+	pin.Clear();
+}
+
+void Pulse(CGPIO& gpio)
+{
+	g_pinTiming.WaitBeforeEdge();
+	gpio.Set();
+	g_pinTiming.WaitHigh();
+	gpio.Clear();
+}
+
+enum EShiftStore : uint8_t
+{
+	SetSI,
+	SetSCK,
+	ClearSI,
+	ClearSCK,
+	ClearSISCK,
+	NumShiftStores,
+};
+
+struct SShiftSequence
+{
+	static constexpr int maxStores = 3 * 8 + 1;
+
+	uint8_t numStores;
+	uint8_t stores[maxStores];
+};
+
+constexpr SShiftSequence CompileShiftSequence(uint8_t value, bool sameBank)
+{
+	SShiftSequence ret{};
+	auto push = [&ret](EShiftStore store) { ret.stores[ret.numStores++] = store; };
+
+	constexpr int siUnknown = -1;
+	int si = siUnknown;
+	for(int i = 0; i < 8; ++i)
+	{
+		auto lsb = value & 0b1;
+		auto sckHigh = i != 0;
+		if(lsb)
+		{
+			if(sckHigh)
+				push(ClearSCK);
+			if(si != 1)
+				push(SetSI);
+		}
+		else if(si == 0)
+			push(ClearSCK);
+		else if(sameBank)
+			push(ClearSISCK);
+		else
+		{
+			if(sckHigh)
+				push(ClearSCK);
+			push(ClearSI);
+		}
+		push(SetSCK);
+		si = lsb;
+		value = static_cast<uint8_t>(value >> 1);
+	}
+	push(ClearSCK);
+	return ret;
+}
+
+struct SShiftTable
+{
+	SShiftSequence sequences[256];
+};
+
+constexpr SShiftTable CompileShiftTable(bool sameBank)
+{
+	SShiftTable ret{};
+	for(int i = 0; i < 256; ++i)
+		ret.sequences[i] = CompileShiftSequence(static_cast<uint8_t>(i), sameBank);
+	return ret;
+}
+
+constexpr SShiftTable sameBankShiftTable = CompileShiftTable(true);
+constexpr SShiftTable splitBankShiftTable = CompileShiftTable(false);
+
+constexpr bool IsSameBank(int id1, int id2)
+{
+	return GetBank(id1) == GetBank(id2);
+}
+
+class CShiftRegister
+{
+public:
+	explicit CShiftRegister(CGPIOPort& port, int siID, int rckID, int sckID, int length = 1);
+	~CShiftRegister();
+	void Write(uint8_t value);
+	void Write(span<const uint8_t> frame);
+	void Flush();
+private:
+	CGPIOPort& port;
+	CGPIO si;
+	CGPIO rck;
+	CGPIO sck;
+	const SShiftTable& table;
+	const CGPIOPort::SStore stores[NumShiftStores];
+	const int length;
+};
+
+CShiftRegister::CShiftRegister(CGPIOPort& port, int siID, int rckID, int sckID, int length)
+	: port{ port }
+	, si{ port, siID }
+	, rck{ port, rckID }
+	, sck{ port, sckID }
+	, table{ IsSameBank(siID, sckID) ? sameBankShiftTable : splitBankShiftTable }
+	, stores
+	{
+		port.MakeStore(GPIOSet, GetBank(siID), GetSetClearValue(siID)),
+		port.MakeStore(GPIOSet, GetBank(sckID), GetSetClearValue(sckID)),
+		port.MakeStore(GPIOClear, GetBank(siID), GetSetClearValue(siID)),
+		port.MakeStore(GPIOClear, GetBank(sckID), GetSetClearValue(sckID)),
+		port.MakeStore(GPIOClear, GetBank(siID), GetSetClearValue(siID) | GetSetClearValue(sckID)),
+	}
+	, length{ length }
+{
+}
+
+void CShiftRegister::Write(uint8_t value)
+{
+	auto& sequence = table.sequences[value];
+	for(int i = 0; i < sequence.numStores; ++i)
+	{
+		auto store = sequence.stores[i];
+		if(store == SetSCK)
+		{
+			g_pinTiming.WaitBeforeEdge();
+			port.Apply(stores[store]);
+			g_pinTiming.WaitHigh();
+		}
+		else
+			port.Apply(stores[store]);
+	}
+}
+
+void CShiftRegister::Write(span<const uint8_t> frame)
+{
+	for(auto x : frame)
+		Write(x);
+}
+
+void CShiftRegister::Flush()
+{
+	Pulse(rck);
+}
+
+CShiftRegister::~CShiftRegister()
+{
+	for(int i = 0; i < length; ++i)
+		Write(0b11111111);
+	Flush();
+}
+
+template<int SI, int RCK, int SCK, int Length = 1>
+class CStaticShiftRegister
+{
+public:
+	explicit CStaticShiftRegister(CGPIOPort& port);
+	~CStaticShiftRegister();
+	void Write(uint8_t value) noexcept;
+	void Write(span<const uint8_t> frame) noexcept;
+	void WriteHoldingClock(uint8_t value) noexcept;
+	void Flush() noexcept { Pulse(rck); }
+private:
+	static constexpr auto& table = IsSameBank(SI, SCK) ? sameBankShiftTable : splitBankShiftTable;
+	static_assert(table.sequences[0].stores[table.sequences[0].numStores - 1] == ClearSCK);
+
+	void Apply(uint8_t store) noexcept;
+
+	CGPIOPort& port;
+	CPin<SI> si;
+	CPin<RCK> rck;
+	CPin<SCK> sck;
+};
+
+template<int SI, int RCK, int SCK, int Length>
+CStaticShiftRegister<SI, RCK, SCK, Length>::CStaticShiftRegister(CGPIOPort& port)
+	: port{ port }, si{ port }, rck{ port }, sck{ port }
+{
+}
+
+template<int SI, int RCK, int SCK, int Length>
+void CStaticShiftRegister<SI, RCK, SCK, Length>::Apply(uint8_t store) noexcept
+{
+	switch(store)
+	{
+	case SetSI: SPinSet<SI>::template Store<GPIOSet>(port); break;
+	case SetSCK:
+		g_pinTiming.WaitBeforeEdge();
+		SPinSet<SCK>::template Store<GPIOSet>(port);
+		g_pinTiming.WaitHigh();
+		break;
+	case ClearSI: SPinSet<SI>::template Store<GPIOClear>(port); break;
+	case ClearSCK: SPinSet<SCK>::template Store<GPIOClear>(port); break;
+	case ClearSISCK: SPinSet<SI, SCK>::template Store<GPIOClear>(port); break;
+	}
+}
+
+template<int SI, int RCK, int SCK, int Length>
+void CStaticShiftRegister<SI, RCK, SCK, Length>::Write(uint8_t value) noexcept
+{
+	auto& sequence = table.sequences[value];
+	for(int i = 0; i < sequence.numStores; ++i)
+		Apply(sequence.stores[i]);
+}
+
+template<int SI, int RCK, int SCK, int Length>
+void CStaticShiftRegister<SI, RCK, SCK, Length>::Write(span<const uint8_t> frame) noexcept
+{
+	for(auto x : frame)
+		Write(x);
+}
+
+template<int SI, int RCK, int SCK, int Length>
+void CStaticShiftRegister<SI, RCK, SCK, Length>::WriteHoldingClock(uint8_t value) noexcept
+{
+	auto& sequence = table.sequences[value];
+	for(int i = 0; i < sequence.numStores - 1; ++i)
+		Apply(sequence.stores[i]);
+}
+
+template<int SI, int RCK, int SCK, int Length>
+CStaticShiftRegister<SI, RCK, SCK, Length>::~CStaticShiftRegister()
+{
+	for(int i = 0; i < Length; ++i)
+		Write(0b11111111);
+	Flush();
+}
+
+constexpr int noPin = -1;
+
+// Segments are active low, a..g from bit 7 down to bit 1, and the point in bit 0.
+constexpr uint8_t pointMask = 0b11111110;
+constexpr int fontSize = 128;
+
+struct SFont
+{
+	uint8_t glyphs[fontSize];
+};
+
+constexpr uint8_t MakeGlyph(string_view segments)
+{
+	uint8_t ret = 0b11111111;
+	for(auto c : segments)
+		ret &= static_cast<uint8_t>(c == '.' ? pointMask : ~(0b10000000 >> (c - 'a')));
+	return ret;
+}
+
+constexpr SFont MakeAsciiFont()
+{
+	constexpr const char* letters[] =
+	{
+		"abcefg", "cdefg", "adef", "bcdeg", "adefg", "aefg", "acdef", "bcefg", "ef", "bcde", "acefg", "def", "aceg",
+		"ceg", "cdeg", "abefg", "abcfg", "eg", "acdfg", "defg", "cde", "bcdef", "bdf", "bcefg", "bcdfg", "abdeg",
+	};
+	constexpr const char* digits[] = { "abcdef", "bc", "abdeg", "abcdg", "bcfg", "acdfg", "acdefg", "abc", "abcdefg", "abcdfg" };
+
+	SFont ret{};
+	for(auto& x : ret.glyphs)
+		x = 0b11111111;
+	for(int i = 0; i < 26; ++i)
+		ret.glyphs['A' + i] = ret.glyphs['a' + i] = MakeGlyph(letters[i]);
+	for(int i = 0; i < 10; ++i)
+		ret.glyphs['0' + i] = MakeGlyph(digits[i]);
+	ret.glyphs['c'] = MakeGlyph("deg");
+	ret.glyphs['o'] = MakeGlyph("cdeg");
+	ret.glyphs['O'] = MakeGlyph("abcdef");
+	ret.glyphs['u'] = MakeGlyph("cde");
+	ret.glyphs['U'] = MakeGlyph("bcdef");
+	ret.glyphs['-'] = MakeGlyph("g");
+	ret.glyphs['_'] = MakeGlyph("d");
+	ret.glyphs['='] = MakeGlyph("dg");
+	ret.glyphs['"'] = MakeGlyph("bf");
+	ret.glyphs['\''] = MakeGlyph("f");
+	ret.glyphs['['] = ret.glyphs['('] = MakeGlyph("adef");
+	ret.glyphs[']'] = ret.glyphs[')'] = MakeGlyph("abcd");
+	ret.glyphs['?'] = MakeGlyph("abeg");
+	ret.glyphs['.'] = ret.glyphs[','] = MakeGlyph(".");
+	ret.glyphs['!'] = MakeGlyph("b.");
+	ret.glyphs['/'] = MakeGlyph("beg");
+	ret.glyphs['\\'] = MakeGlyph("cfg");
+	return ret;
+}
+
+constexpr SFont asciiFont = MakeAsciiFont();
+constexpr char hexDigits[] = "0123456789ABCDEF";
+
+static_assert(asciiFont.glyphs['0'] == 0b00000011 && asciiFont.glyphs['8'] == 0b00000001 && asciiFont.glyphs['F'] == 0b01110001);
+
+// Bytes outside ASCII come out blank without a branch.
+constexpr uint8_t GetGlyph(char c)
+{
+	auto u = static_cast<uint8_t>(c);
+	return static_cast<uint8_t>(asciiFont.glyphs[u & (fontSize - 1)] | -(u >> 7));
+}
+
+constexpr uint8_t Get7SegBits(int value)
+{
+	return GetGlyph(hexDigits[value & 0b1111]);
+}
+
+constexpr uint8_t Get7SegBitsWithPoint(int value, bool hasPoint)
+{
+	return static_cast<uint8_t>(Get7SegBits(value) & ~(static_cast<uint8_t>(hasPoint)));
+}
+
+class C4Digits
+{
+public:
+	static constexpr int numDigits = 4;
+
+	explicit C4Digits(CGPIOPort& port, const int (&ids)[numDigits]);
+	template<class WriteFn, class FlushFn>
+	void Switch(WriteFn&& write, FlushFn&& flush);
+	void Blank() { Clear(); }
+	~C4Digits();
+private:
+	void Clear();
+
+	vector<CGPIO> digits;
+	int curDigitIdx;
+};
+
+C4Digits::C4Digits(CGPIOPort& port, const int (&ids)[numDigits])
+	: curDigitIdx{ numDigits - 1 }
+{
+	for(auto id : ids)
+	{
+		if(id != noPin)
+			digits.emplace_back(port, id);
+	}
+	Clear();
+}
+
+template<class WriteFn, class FlushFn>
+void C4Digits::Switch(WriteFn&& write, FlushFn&& flush)
+{
+	auto lastDigitIdx = curDigitIdx;
+	curDigitIdx = (curDigitIdx + 1) % numDigits;
+
+	write(curDigitIdx);
+	if(digits.empty())
+	{
+		flush();
+		return;
+	}
+	digits[lastDigitIdx].Clear();
+	g_pinTiming.WaitBlank();
+	flush();
+	digits[curDigitIdx].Set();
+}
+
+void C4Digits::Clear()
+{
+	for(auto& x : digits)
+		x.Clear();
+}
+
+C4Digits::~C4Digits()
+{
+	Clear();
+}
+
+struct SChainPins
+{
+	int siID;
+	int rckID;
+	int sckID;
+	int digitIDs[C4Digits::numDigits];
+
+	bool operator ==(const SChainPins&) const = default;
+};
+
+bool HasCascadedDigitSelect(const SChainPins& pins)
+{
+	return pins.digitIDs[0] == noPin;
+}
+
+uint8_t GetDigitSelectBits(int digitIdx)
+{
+	return static_cast<uint8_t>(0b1 << digitIdx);
+}
+
+class CDisplayChain
+{
+public:
+	explicit CDisplayChain(CGPIOPort& port, const SChainPins& pins);
+	int GetFrameLength() const noexcept { return frameLength; }
+	void FillFrame(span<uint8_t> frame, int digitIdx, uint8_t segments) const noexcept;
+	void FillBlankFrame(span<uint8_t> frame) const noexcept;
+	CShiftRegister& GetRegister() noexcept { return reg; }
+	C4Digits& GetDigits() noexcept { return digits; }
+private:
+	const int frameLength;
+	CShiftRegister reg;
+	C4Digits digits;
+};
+
+CDisplayChain::CDisplayChain(CGPIOPort& port, const SChainPins& pins)
+	: frameLength{ HasCascadedDigitSelect(pins) ? 2 : 1 }
+	, reg{ port, pins.siID, pins.rckID, pins.sckID, frameLength }
+	, digits{ port, pins.digitIDs }
+{
+}
+
+void CDisplayChain::FillFrame(span<uint8_t> frame, int digitIdx, uint8_t segments) const noexcept
+{
+	for(auto& x : frame)
+		x = 0b11111111;
+	if(frameLength == 2)
+		frame[frame.size() - 2] = GetDigitSelectBits(digitIdx);
+	frame.back() = segments;
+}
+
+void CDisplayChain::FillBlankFrame(span<uint8_t> frame) const noexcept
+{
+	for(auto& x : frame)
+		x = 0b11111111;
+	if(frameLength == 2)
+		frame[frame.size() - 2] = 0;
+}
+
+class CDisplayGroup
+{
+public:
+	static constexpr int numDigits = 4;
+
+	explicit CDisplayGroup(CGPIOPort& port, const vector<SChainPins>& pins);
+	int GetNumChains() const noexcept { return static_cast<int>(chains.size()); }
+	int GetNumBits() const noexcept { return frameLength * 8; }
+	bool IsInBank(int bank) const noexcept;
+	const SBankMasks& GetSCK() const noexcept { return sck; }
+	const SBankMasks& GetRCK() const noexcept { return rck; }
+	const SBankMasks& GetDigitMasks(int digitIdx) const noexcept { return digits[digitIdx]; }
+	template<class WriteFn>
+	void Encode(int digitIdx, WriteFn&& write);
+	void GetBitMasks(int bit, SBankMasks& high, SBankMasks& low) const noexcept;
+	template<class WriteFn>
+	void Switch(WriteFn&& write);
+	void Blank();
+private:
+	struct SPin
+	{
+		int bank;
+		uint32_t value;
+	};
+
+	void Store(EGPIOStore kind, const SBankMasks& masks);
+	void ShiftOut(const SBankMasks& lastDigits);
+
+	CGPIOPort& port;
+	vector<unique_ptr<CDisplayChain>> chains;
+	vector<SPin> siPins;
+	int frameLength;
+	vector<uint8_t> frames;
+	SBankMasks sck;
+	SBankMasks rck;
+	SBankMasks digits[numDigits];
+	int curDigitIdx;
+};
+
+CDisplayGroup::CDisplayGroup(CGPIOPort& port, const vector<SChainPins>& pins)
+	: port{ port }
+	, frameLength{ 0 }
+	, sck{}, rck{}, digits{}
+	, curDigitIdx{ numDigits - 1 }
+{
+	for(auto& x : pins)
+	{
+		chains.push_back(make_unique<CDisplayChain>(port, x));
+		frameLength = max(frameLength, chains.back()->GetFrameLength());
+		siPins.push_back(SPin{ GetBank(x.siID), GetSetClearValue(x.siID) });
+		AddToMasks(sck, x.sckID);
+		AddToMasks(rck, x.rckID);
+		for(int i = 0; i < numDigits; ++i)
+			AddToMasks(digits[i], x.digitIDs[i]);
+	}
+	frames.resize(chains.size() * frameLength);
+}
+
+bool CDisplayGroup::IsInBank(int bank) const noexcept
+{
+	for(auto& x : siPins)
+	{
+		if(x.bank != bank)
+			return false;
+	}
+	for(int i = 0; i < numBanks; ++i)
+	{
+		if(i == bank)
+			continue;
+		auto masks = sck.masks[i] | rck.masks[i];
+		for(auto& x : digits)
+			masks |= x.masks[i];
+		if(masks != 0)
+			return false;
+	}
+	return true;
+}
+
+template<class WriteFn>
+void CDisplayGroup::Encode(int digitIdx, WriteFn&& write)
+{
+	for(size_t i = 0; i < chains.size(); ++i)
+	{
+		auto frame = span{ frames }.subspan(i * frameLength, frameLength);
+		chains[i]->FillFrame(frame, digitIdx, write(static_cast<int>(i), digitIdx));
+	}
+}
+
+void CDisplayGroup::GetBitMasks(int bit, SBankMasks& high, SBankMasks& low) const noexcept
+{
+	high = SBankMasks{};
+	low = SBankMasks{};
+	for(size_t i = 0; i < siPins.size(); ++i)
+	{
+		auto& pin = siPins[i];
+		auto value = frames[i * frameLength + bit / 8];
+		auto& masks = ((value >> (bit % 8)) & 0b1) ? high : low;
+		masks.masks[pin.bank] |= pin.value;
+	}
+}
+
+void CDisplayGroup::Store(EGPIOStore kind, const SBankMasks& masks)
+{
+	for(int i = 0; i < numBanks; ++i)
+	{
+		if(masks.masks[i])
+			port.Store(kind, i, masks.masks[i]);
+	}
+}
+
+void CDisplayGroup::ShiftOut(const SBankMasks& lastDigits)
+{
+	SBankMasks siHigh{};
+	SBankMasks siLow{};
+	for(int bit = 0; bit < GetNumBits(); ++bit)
+	{
+		SBankMasks high;
+		SBankMasks low;
+		GetBitMasks(bit, high, low);
+
+		SBankMasks clear{};
+		SBankMasks set{};
+		for(int i = 0; i < numBanks; ++i)
+		{
+			clear.masks[i] = (bit != 0 ? sck.masks[i] : 0) | (low.masks[i] & ~siLow.masks[i]);
+			set.masks[i] = high.masks[i] & ~siHigh.masks[i];
+		}
+		Store(GPIOClear, clear);
+		Store(GPIOSet, set);
+		g_pinTiming.WaitBeforeEdge();
+		Store(GPIOSet, sck);
+		g_pinTiming.WaitHigh();
+		siHigh = high;
+		siLow = low;
+	}
+
+	SBankMasks clear{};
+	for(int i = 0; i < numBanks; ++i)
+		clear.masks[i] = sck.masks[i] | lastDigits.masks[i];
+	Store(GPIOClear, clear);
+}
+
+template<class WriteFn>
+void CDisplayGroup::Switch(WriteFn&& write)
+{
+	if(chains.size() == 1)
+	{
+		auto& chain = *chains.front();
+		auto& reg = chain.GetRegister();
+		chain.GetDigits().Switch(
+			[this, &chain, &reg, &write] (int curDigitIdx)
+			{
+				chain.FillFrame(frames, curDigitIdx, write(0, curDigitIdx));
+				reg.Write(frames);
+			},
+			[&reg] () { reg.Flush(); });
+		return;
+	}
+
+	auto lastDigitIdx = curDigitIdx;
+	curDigitIdx = (curDigitIdx + 1) % numDigits;
+
+	Encode(curDigitIdx, write);
+	ShiftOut(digits[lastDigitIdx]);
+	g_pinTiming.WaitBlank();
+	g_pinTiming.WaitBeforeEdge();
+	Store(GPIOSet, rck);
+	g_pinTiming.WaitHigh();
+	Store(GPIOClear, rck);
+	Store(GPIOSet, digits[curDigitIdx]);
+}
+
+template<int SI, int RCK, int SCK, int... DigitIDs>
+class CStaticDisplay
+{
+public:
+	static constexpr int numDigits = C4Digits::numDigits;
+
+	explicit CStaticDisplay(CGPIOPort& port);
+	template<class WriteFn>
+	void Switch(WriteFn&& write);
+	void Blank() noexcept { SPinSet<DigitIDs...>::template Store<GPIOClear>(port); }
+	static constexpr int GetNumChains() noexcept { return 1; }
+private:
+	static_assert(sizeof...(DigitIDs) == numDigits);
+	static constexpr int digitIDs[numDigits] = { DigitIDs... };
+
+	template<size_t... I>
+	void SetDigit(int digitIdx, index_sequence<I...>) noexcept;
+
+	CGPIOPort& port;
+	CStaticShiftRegister<SI, RCK, SCK> reg;
+	C4Digits digits;
+	int curDigitIdx;
+};
+
+template<int SI, int RCK, int SCK, int... DigitIDs>
+CStaticDisplay<SI, RCK, SCK, DigitIDs...>::CStaticDisplay(CGPIOPort& port)
+	: port{ port }, reg{ port }, digits{ port, digitIDs }
+	, curDigitIdx{ numDigits - 1 }
+{
+}
+
+template<int SI, int RCK, int SCK, int... DigitIDs>
+template<size_t... I>
+void CStaticDisplay<SI, RCK, SCK, DigitIDs...>::SetDigit(int digitIdx, index_sequence<I...>) noexcept
+{
+	((digitIdx == static_cast<int>(I) ? SPinSet<digitIDs[I]>::template Store<GPIOSet>(port) : void()), ...);
+}
+
+template<int SI, int RCK, int SCK, int... DigitIDs>
+template<class WriteFn>
+void CStaticDisplay<SI, RCK, SCK, DigitIDs...>::Switch(WriteFn&& write)
+{
+	curDigitIdx = (curDigitIdx + 1) % numDigits;
+
+	reg.WriteHoldingClock(write(0, curDigitIdx));
+	SPinSet<SCK, DigitIDs...>::template Store<GPIOClear>(port);
+	g_pinTiming.WaitBlank();
+	reg.Flush();
+	SetDigit(curDigitIdx, make_index_sequence<numDigits>{});
+}
+
+// Cascaded chains have no digit lines to clear, so an all-off digit select byte is shifted out and latched instead.
+void CDisplayGroup::Blank()
+{
+	if(chains.size() == 1)
+	{
+		auto& chain = *chains.front();
+		if(chain.GetFrameLength() == 1)
+		{
+			chain.GetDigits().Blank();
+			return;
+		}
+		auto& reg = chain.GetRegister();
+		chain.FillBlankFrame(frames);
+		reg.Write(frames);
+		reg.Flush();
+		return;
+	}
+	if(frameLength == 1)
+	{
+		Store(GPIOClear, digits[curDigitIdx]);
+		return;
+	}
+
+	for(size_t i = 0; i < chains.size(); ++i)
+		chains[i]->FillBlankFrame(span{ frames }.subspan(i * frameLength, frameLength));
+	ShiftOut(digits[curDigitIdx]);
+	g_pinTiming.WaitBeforeEdge();
+	Store(GPIOSet, rck);
+	g_pinTiming.WaitHigh();
+	Store(GPIOClear, rck);
+}
+
+int GetDigit(uint16_t value4, int digitIdx)
+{
+	return (value4 >> ((3 - digitIdx) * 4)) & 0b1111;
+}
+
+struct SMyValue
+{
+	uint16_t value4;
+	bool point;
+};
+
+uint16_t CreateValue4(uint8_t digit12, uint8_t digit34)
+{
+	return static_cast<uint16_t>((digit12 << 8) | digit34);
+}
+
+uint8_t CreateValue2(int value)
+{
+	return static_cast<uint8_t>(((value / 10) << 4) | (value % 10));
+}
+
+uint8_t GetSegments(const SMyValue& value, int digitIdx)
+{
+	return Get7SegBitsWithPoint(GetDigit(value.value4, digitIdx), (digitIdx == 1 && value.point));
+}
+
+struct SFrame
+{
+	uint8_t segments[C4Digits::numDigits];
+};
+
+constexpr uint8_t blankSegments = 0b11111111;
+constexpr SFrame blankFrame{ { blankSegments, blankSegments, blankSegments, blankSegments } };
+
+SFrame EncodeFrame(const SMyValue& value)
+{
+	SFrame ret;
+	for(int i = 0; i < C4Digits::numDigits; ++i)
+		ret.segments[i] = GetSegments(value, i);
+	return ret;
+}
+
+// A '.' or ',' lights the point of the preceding glyph unless that one already has it.
+vector<uint8_t> LayoutText(string_view text)
+{
+	vector<uint8_t> ret;
+	ret.reserve(text.size());
+	for(auto c : text)
+	{
+		auto glyph = GetGlyph(c);
+		if(glyph == pointMask && !ret.empty() && (ret.back() & ~pointMask))
+			ret.back() &= pointMask;
+		else
+			ret.push_back(glyph);
+	}
+	return ret;
+}
+
+SFrame EncodeText(string_view text)
+{
+	auto glyphs = LayoutText(text);
+	auto ret = blankFrame;
+	copy_n(glyphs.begin(), min(glyphs.size(), size(ret.segments)), ret.segments);
+	return ret;
+}
+
+// Text longer than the display is laid out once into every window of a cyclic scroll, so stepping costs a lookup.
+class CScrollText
+{
+public:
+	static constexpr int gap = C4Digits::numDigits;
+
+	CScrollText();
+	explicit CScrollText(const SFrame& frame);
+	explicit CScrollText(string_view text);
+	const SFrame& Get(size_t step) const noexcept { return frames[step % frames.size()]; }
+	size_t GetNumSteps() const noexcept { return frames.size(); }
+private:
+	vector<SFrame> frames;
+};
+
+CScrollText::CScrollText()
+	: CScrollText{ blankFrame }
+{
+}
+
+CScrollText::CScrollText(const SFrame& frame)
+	: frames{ frame }
+{
+}
+
+CScrollText::CScrollText(string_view text)
+{
+	auto glyphs = LayoutText(text);
+	if(glyphs.size() <= size_t{ C4Digits::numDigits })
+	{
+		frames.push_back(EncodeText(text));
+		return;
+	}
+	glyphs.insert(glyphs.end(), gap, blankSegments);
+	frames.resize(glyphs.size());
+	for(size_t step = 0; step < glyphs.size(); ++step)
+	{
+		for(int i = 0; i < C4Digits::numDigits; ++i)
+			frames[step].segments[i] = glyphs[(step + i) % glyphs.size()];
+	}
+}
+
+constexpr uint8_t fullDuty = 100;
+
+struct SBrightness
+{
+	uint8_t duty[C4Digits::numDigits];
+
+	bool operator ==(const SBrightness&) const = default;
+};
+
+constexpr SBrightness fullBrightness{ { fullDuty, fullDuty, fullDuty, fullDuty } };
+
+class CBrightness
+{
+public:
+	explicit CBrightness(const SBrightness& brightness);
+	void Store(const SBrightness& brightness) noexcept;
+	SBrightness Load() const noexcept;
+private:
+	static uint32_t Pack(const SBrightness& brightness) noexcept;
+
+	atomic<uint32_t> packed;
+	static_assert(atomic<uint32_t>::is_always_lock_free);
+};
+
+CBrightness::CBrightness(const SBrightness& brightness)
+	: packed{ Pack(brightness) }
+{
+}
+
+uint32_t CBrightness::Pack(const SBrightness& brightness) noexcept
+{
+	uint32_t ret = 0;
+	for(int i = 0; i < C4Digits::numDigits; ++i)
+		ret |= static_cast<uint32_t>(brightness.duty[i]) << (i * 8);
+	return ret;
+}
+
+void CBrightness::Store(const SBrightness& brightness) noexcept
+{
+	packed.store(Pack(brightness), memory_order_relaxed);
+}
+
+SBrightness CBrightness::Load() const noexcept
+{
+	auto x = packed.load(memory_order_relaxed);
+	SBrightness ret;
+	for(int i = 0; i < C4Digits::numDigits; ++i)
+		ret.duty[i] = static_cast<uint8_t>(x >> (i * 8));
+	return ret;
+}
+
+constexpr int numSegments = 8;
+constexpr int noCurrentLimit = 0;
+
+// Lit segments share one driver, so each is brighter the fewer there are; on-time in proportion to the lit count evens it out.
+struct SSegmentDuty
+{
+	uint8_t duty[numSegments + 1];
+};
+
+constexpr SSegmentDuty MakeSegmentDuty()
+{
+	SSegmentDuty ret{};
+	for(int lit = 0; lit <= numSegments; ++lit)
+		ret.duty[lit] = static_cast<uint8_t>((lit * fullDuty + numSegments - 1) / numSegments);
+	return ret;
+}
+
+constexpr auto segmentDuty = MakeSegmentDuty();
+
+constexpr int GetLitSegments(uint8_t segments)
+{
+	return numSegments - popcount(segments);
+}
+
+// maxSegments caps the lit segments per digit, averaged over the frame and summed over the chains.
+SBrightness BalanceBrightness(const SBrightness& brightness, const SFrame& frame, int maxSegments, int numChains) noexcept
+{
+	if(maxSegments == noCurrentLimit)
+		return brightness;
+
+	SBrightness ret;
+	uint32_t total = 0;
+	for(int i = 0; i < C4Digits::numDigits; ++i)
+	{
+		auto lit = GetLitSegments(frame.segments[i]);
+		ret.duty[i] = static_cast<uint8_t>(brightness.duty[i] * segmentDuty.duty[lit] / fullDuty);
+		total += static_cast<uint32_t>(lit * numChains * ret.duty[i]);
+	}
+	auto limit = static_cast<uint32_t>(maxSegments * C4Digits::numDigits * fullDuty);
+	if(limit < total)
+	{
+		for(auto& x : ret.duty)
+			x = static_cast<uint8_t>(x * limit / total);
+	}
+	return ret;
+}
+
+class CFrameBuffer
+{
+public:
+	explicit CFrameBuffer(const SFrame& frame);
+	void Publish(const SFrame& frame) noexcept;
+	const SFrame& Acquire() noexcept;
+private:
+	static constexpr uint8_t indexMask = 0b011;
+	static constexpr uint8_t dirtyBit = 0b100;
+
+	SFrame buffers[3];
+	uint8_t backIdx;
+	uint8_t frontIdx;
+	atomic<uint8_t> middle;
+	static_assert(atomic<uint8_t>::is_always_lock_free);
+};
+
+CFrameBuffer::CFrameBuffer(const SFrame& frame)
+	: buffers{ frame, frame, frame }
+	, backIdx{ 0 }, frontIdx{ 1 }, middle{ 2 }
+{
+}
+
+void CFrameBuffer::Publish(const SFrame& frame) noexcept
+{
+	buffers[backIdx] = frame;
+	auto prev = middle.exchange(static_cast<uint8_t>(backIdx | dirtyBit), memory_order_acq_rel);
+	backIdx = prev & indexMask;
+}
+
+const SFrame& CFrameBuffer::Acquire() noexcept
+{
+	if(middle.load(memory_order_relaxed) & dirtyBit)
+	{
+		auto prev = middle.exchange(frontIdx, memory_order_acq_rel);
+		frontIdx = prev & indexMask;
+	}
+	return buffers[frontIdx];
+}
+
+class CFrameRing
+{
+public:
+	static constexpr uint32_t magic = 0x37534547;
+	static constexpr uint32_t numSlots = 64;
+
+	struct SHeader
+	{
+		uint32_t magic;
+		uint32_t numSlots;
+		atomic<uint32_t> head;
+		atomic<uint32_t> tail;
+	};
+
+	explicit CFrameRing();
+	CFrameRing(const CFrameRing&) = delete;
+	CFrameRing& operator =(const CFrameRing&) = delete;
+	~CFrameRing();
+	int GetFD() const noexcept { return fd; }
+	const SFrame* Acquire() noexcept;
+
+	struct CreateError {};
+private:
+	static constexpr int errFD = -1;
+	static constexpr int timeoutCycles = 50;
+	static constexpr size_t size = sizeof(SHeader) + numSlots * sizeof(SFrame);
+	static_assert(atomic<uint32_t>::is_always_lock_free);
+
+	SHeader& GetHeader() noexcept { return *static_cast<SHeader*>(map); }
+	const SFrame* GetSlots() const noexcept { return reinterpret_cast<const SFrame*>(static_cast<const uint8_t*>(map) + sizeof(SHeader)); }
+
+	const int fd;
+	void* map;
+	SFrame current;
+	bool hasCurrent;
+	int idleCycles;
+};
+
+CFrameRing::CFrameRing()
+	: fd{ memfd_create("clock-driver-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING) }
+	, map{ MAP_FAILED }
+	, current{}, hasCurrent{ false }, idleCycles{ 0 }
+{
+	if(fd == errFD)
+		throw CreateError{};
+	if(ftruncate(fd, size) != 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0
+		|| (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		throw CreateError{};
+	}
+	new (map) SHeader{ magic, numSlots, 0, 0 };
+}
+
+CFrameRing::~CFrameRing()
+{
+	munmap(map, size);
+	close(fd);
+}
+
+const SFrame* CFrameRing::Acquire() noexcept
+{
+	auto& header = GetHeader();
+	auto tail = header.tail.load(memory_order_relaxed);
+	auto head = header.head.load(memory_order_acquire);
+	if(head != tail)
+	{
+		if(head - tail > numSlots)
+			tail = head - 1;
+		current = GetSlots()[tail % numSlots];
+		header.tail.store(tail + 1, memory_order_release);
+		hasCurrent = true;
+		idleCycles = 0;
+		return &current;
+	}
+	if(hasCurrent && ++idleCycles < timeoutCycles)
+		return &current;
+	hasCurrent = false;
+	return nullptr;
+}
+
+// Start/stop state is packed into one word so the refresh thread never sees a half-updated stopwatch.
+class CStopwatch
+{
+public:
+	explicit CStopwatch();
+	void Start(steady_clock::time_point now) noexcept;
+	void Stop(steady_clock::time_point now) noexcept;
+	void Reset() noexcept;
+	void SetShown(bool isShown) noexcept { shown.store(isShown, memory_order_relaxed); }
+	bool IsShown() const noexcept { return shown.load(memory_order_relaxed); }
+	SMyValue Get(steady_clock::time_point now) const noexcept;
+private:
+	static int64_t ToNs(steady_clock::time_point t) noexcept { return duration_cast<nanoseconds>(t.time_since_epoch()).count(); }
+	int64_t GetElapsedNs(int64_t state, steady_clock::time_point now) const noexcept;
+
+	atomic<int64_t> state;
+	atomic<bool> shown;
+};
+
+CStopwatch::CStopwatch()
+	: state{ 0 }, shown{ false }
+{
+}
+
+int64_t CStopwatch::GetElapsedNs(int64_t state, steady_clock::time_point now) const noexcept
+{
+	return (state & 0b1) ? ToNs(now) - (state >> 1) : state >> 1;
+}
+
+void CStopwatch::Start(steady_clock::time_point now) noexcept
+{
+	auto cur = state.load(memory_order_relaxed);
+	if(!(cur & 0b1))
+		state.store(((ToNs(now) - (cur >> 1)) << 1) | 0b1, memory_order_relaxed);
+}
+
+void CStopwatch::Stop(steady_clock::time_point now) noexcept
+{
+	auto cur = state.load(memory_order_relaxed);
+	if(cur & 0b1)
+		state.store(GetElapsedNs(cur, now) << 1, memory_order_relaxed);
+}
+
+void CStopwatch::Reset() noexcept
+{
+	state.store(0, memory_order_relaxed);
+}
+
+// SS.hh for the first minute, MM.SS after that.
+SMyValue CStopwatch::Get(steady_clock::time_point now) const noexcept
+{
+	auto centis = GetElapsedNs(state.load(memory_order_relaxed), now) / 10000000;
+	auto secs = static_cast<int>(centis / 100);
+	if(secs < 60)
+		return SMyValue{ CreateValue4(CreateValue2(secs), CreateValue2(static_cast<int>(centis % 100))), true };
+	return SMyValue{ CreateValue4(CreateValue2(secs / 60 % 100), CreateValue2(secs % 60)), true };
+}
+
+template<class Display>
+struct SSharedValues
+{
+	Display& display;
+	CFrameBuffer& frames;
+	CFrameRing* ring;
+	const CStopwatch& stopwatch;
+	const CBrightness& brightness;
+	microseconds refreshPeriod;
+	int maxSegments;
+};
+
+timespec ToTimespec(steady_clock::time_point t)
+{
+	auto ns = duration_cast<nanoseconds>(t.time_since_epoch()).count();
+	return timespec{ static_cast<time_t>(ns / 1000000000), static_cast<long>(ns % 1000000000) };
+}
+
+void SleepUntil(steady_clock::time_point t)
+{
+	auto deadline = ToTimespec(t);
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR)
+		;
+}
+
+constexpr auto defaultRefreshPeriod = microseconds{ 5000 };
+constexpr auto minRefreshPeriod = microseconds{ 500 };
+constexpr auto maxRefreshPeriod = microseconds{ 50000 };
+
+class CRefreshControl
+{
+public:
+	explicit CRefreshControl();
+	bool IsFinished() const noexcept;
+	bool IsParked() const noexcept;
+	void SetParked(bool parked) noexcept;
+	void Finish() noexcept;
+	void WaitWhileParked() const noexcept;
+	void CountWakeup() noexcept;
+	uint64_t GetWakeups() const noexcept;
+	bool IsBlankRequested() const noexcept { return blankRequested.load(memory_order_relaxed); }
+	void RequestBlank(bool isRequested) noexcept { blankRequested.store(isRequested, memory_order_relaxed); }
+private:
+	enum EState : uint8_t { Running, Parked, Finished };
+
+	atomic<uint8_t> state;
+	atomic<bool> blankRequested;
+	atomic<uint64_t> wakeups;
+	static_assert(atomic<uint64_t>::is_always_lock_free);
+};
+
+CRefreshControl::CRefreshControl()
+	: state{ Running }, blankRequested{ false }, wakeups{ 0 }
+{
+}
+
+bool CRefreshControl::IsFinished() const noexcept
+{
+	return state.load(memory_order_relaxed) == Finished;
+}
+
+bool CRefreshControl::IsParked() const noexcept
+{
+	return state.load(memory_order_relaxed) == Parked;
+}
+
+void CRefreshControl::SetParked(bool parked) noexcept
+{
+	uint8_t expected = parked ? Running : Parked;
+	if(state.compare_exchange_strong(expected, parked ? Parked : Running, memory_order_relaxed))
+		state.notify_one();
+}
+
+void CRefreshControl::Finish() noexcept
+{
+	state.store(Finished, memory_order_relaxed);
+	state.notify_one();
+}
+
+void CRefreshControl::WaitWhileParked() const noexcept
+{
+	state.wait(Parked, memory_order_relaxed);
+}
+
+void CRefreshControl::CountWakeup() noexcept
+{
+	Increment(wakeups);
+}
+
+uint64_t CRefreshControl::GetWakeups() const noexcept
+{
+	return wakeups.load(memory_order_relaxed);
+}
+
+class CHistogram
+{
+public:
+	static constexpr int numBuckets = 20;
+
+	explicit CHistogram();
+	void Add(uint64_t ns) noexcept;
+	void Print(FILE* fp, const char* name) const;
+private:
+	static constexpr int firstShift = 10;
+
+	atomic<uint64_t> counts[numBuckets];
+};
+
+CHistogram::CHistogram()
+	: counts{}
+{
+}
+
+void CHistogram::Add(uint64_t ns) noexcept
+{
+	auto bucket = min(static_cast<int>(bit_width(ns >> firstShift)), numBuckets - 1);
+	Increment(counts[bucket]);
+}
+
+void CHistogram::Print(FILE* fp, const char* name) const
+{
+	fprintf(fp, "%s", name);
+	for(int i = 0; i < numBuckets; ++i)
+	{
+		auto count = counts[i].load(memory_order_relaxed);
+		if(count == 0)
+			continue;
+		if(i == numBuckets - 1)
+			fprintf(fp, " inf:%llu", static_cast<unsigned long long>(count));
+		else
+			fprintf(fp, " <%llu:%llu", 1ULL << (i + firstShift), static_cast<unsigned long long>(count));
+	}
+	fprintf(fp, "\n");
+}
+
+struct SRefreshStats
+{
+	atomic<uint64_t> refreshes{ 0 };
+	atomic<uint64_t> missedDeadlines{ 0 };
+	CHistogram periodJitter;
+	CHistogram switchTime;
+	CHistogram onTime[C4Digits::numDigits];
+
+	void Print(FILE* fp) const;
+};
+
+void SRefreshStats::Print(FILE* fp) const
+{
+	fprintf(fp, "refreshes %llu\n", static_cast<unsigned long long>(refreshes.load(memory_order_relaxed)));
+	fprintf(fp, "missed_deadlines %llu\n", static_cast<unsigned long long>(missedDeadlines.load(memory_order_relaxed)));
+	periodJitter.Print(fp, "period_jitter_ns");
+	switchTime.Print(fp, "switch_ns");
+	for(int i = 0; i < C4Digits::numDigits; ++i)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "on_time_ns_digit%d", i);
+		onTime[i].Print(fp, name);
+	}
+}
+
+// onCycle runs once per multiplex cycle, right after its first digit is lit, and waitParked while the display is parked;
+// that is where a caller living on this thread does its own work.
+template<class Display, class CycleFn, class WaitParkedFn>
+void RunRefreshLoop(CRefreshControl& control, SRefreshStats& stats, const SSharedValues<Display>& sharedValues, CycleFn&& onCycle, WaitParkedFn&& waitParked)
+{
+	auto& display = sharedValues.display;
+	auto& frames = sharedValues.frames;
+	auto& brightness = sharedValues.brightness;
+	auto refreshPeriod = sharedValues.refreshPeriod;
+	auto maxSegments = sharedValues.maxSegments;
+	auto numChains = display.GetNumChains();
+
+	auto ring = sharedValues.ring;
+	auto& stopwatch = sharedValues.stopwatch;
+
+	auto pFrame = &frames.Acquire();
+	SFrame liveFrame;
+	auto cycleBrightness = brightness.Load();
+	int digitIdx = 0;
+	bool isNewCycle = false;
+	auto write = [&frames, &brightness, ring, &stopwatch, maxSegments, numChains, &pFrame, &liveFrame, &cycleBrightness, &digitIdx, &isNewCycle] (int chainIdx, int curDigitIdx)
+	{
+		if(chainIdx == 0 && curDigitIdx == 0)
+		{
+			isNewCycle = true;
+			auto pRingFrame = ring ? ring->Acquire() : nullptr;
+			if(pRingFrame)
+				pFrame = pRingFrame;
+			else if(stopwatch.IsShown())
+			{
+				liveFrame = EncodeFrame(stopwatch.Get(steady_clock::now()));
+				pFrame = &liveFrame;
+			}
+			else
+				pFrame = &frames.Acquire();
+			cycleBrightness = BalanceBrightness(brightness.Load(), *pFrame, maxSegments, numChains);
+		}
+		digitIdx = curDigitIdx;
+		return pFrame->segments[curDigitIdx];
+	};
+	auto sleep = [&control] (steady_clock::time_point t)
+	{
+		SleepUntil(t);
+		control.CountWakeup();
+	};
+	auto periodNs = static_cast<uint64_t>(duration_cast<nanoseconds>(refreshPeriod).count());
+	uint64_t prevStart = 0;
+	uint64_t onSince = 0;
+	int onDigitIdx = 0;
+	auto deadline = steady_clock::now();
+	while(!control.IsFinished())
+	{
+		if(control.IsParked())
+		{
+			display.Blank();
+			waitParked();
+			deadline = steady_clock::now();
+			prevStart = onSince = 0;
+			continue;
+		}
+		if(control.IsBlankRequested())
+		{
+			// Counting the blank cycles shows the watchdog this thread runs again, which lifts the request.
+			display.Blank();
+			Increment(stats.refreshes);
+			sleep(steady_clock::now() + refreshPeriod);
+			deadline = steady_clock::now();
+			prevStart = onSince = 0;
+			continue;
+		}
+		auto start = GetRawTime();
+		if(onSince != 0)
+			stats.onTime[onDigitIdx].Add(start - onSince);
+		if(prevStart != 0)
+		{
+			auto period = start - prevStart;
+			stats.periodJitter.Add(period < periodNs ? periodNs - period : period - periodNs);
+		}
+		prevStart = start;
+
+		display.Switch(write);
+		onSince = GetRawTime();
+		onDigitIdx = digitIdx;
+		stats.switchTime.Add(onSince - start);
+		Increment(stats.refreshes);
+		if(isNewCycle)
+		{
+			isNewCycle = false;
+			onCycle();
+		}
+
+		auto duty = cycleBrightness.duty[digitIdx];
+		if(duty < fullDuty)
+		{
+			sleep(deadline + refreshPeriod * duty / fullDuty);
+			display.Blank();
+			stats.onTime[onDigitIdx].Add(GetRawTime() - onSince);
+			onSince = 0;
+		}
+		deadline += refreshPeriod;
+		auto now = steady_clock::now();
+		if(deadline < now)
+		{
+			Increment(stats.missedDeadlines);
+			if(deadline + refreshPeriod < now)
+				deadline = now;
+		}
+		sleep(deadline);
+	}
+	display.Blank();
+}
+
+template<class Display>
+void DispThread(CRefreshControl* pControl, SRefreshStats* pStats, const SSharedValues<Display>* pSharedValues)
+{
+	RunRefreshLoop(*pControl, *pStats, *pSharedValues, [] () {}, [pControl] () { pControl->WaitWhileParked(); });
+}
+
+struct SRealTimeConfig
+{
+	bool enabled;
+	int priority;
+	int cpu;
+
+	bool operator ==(const SRealTimeConfig&) const = default;
+};
+
+constexpr SRealTimeConfig defaultRealTimeConfig{ false, 80, -1 };
+
+void SetRealTime(pthread_t handle, const SRealTimeConfig& config)
+{
+	if(!config.enabled)
+		return;
+
+	sched_param param{};
+	param.sched_priority = config.priority;
+	if(pthread_setschedparam(handle, SCHED_FIFO, &param) != 0)
+		printf("SCHED_FIFO unavailable, using default scheduling\n");
+
+	auto cpu = config.cpu >= 0 ? config.cpu : static_cast<int>(thread::hardware_concurrency()) - 1;
+	if(cpu >= 0)
+	{
+		cpu_set_t cpuSet;
+		CPU_ZERO(&cpuSet);
+		CPU_SET(cpu, &cpuSet);
+		if(pthread_setaffinity_np(handle, sizeof(cpuSet), &cpuSet) != 0)
+			printf("cannot pin display thread to CPU %d\n", cpu);
+	}
+
+	if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+		printf("mlockall unavailable, memory stays pageable\n");
+}
+
+// Puts a thread's scheduling policy and CPU affinity back as they were, for a thread that only refreshes for a while.
+class CSavedScheduling
+{
+public:
+	explicit CSavedScheduling(pthread_t handle);
+	CSavedScheduling(const CSavedScheduling&) = delete;
+	CSavedScheduling& operator =(const CSavedScheduling&) = delete;
+	~CSavedScheduling();
+private:
+	const pthread_t handle;
+	int policy;
+	sched_param param;
+	cpu_set_t cpuSet;
+	bool hasCpuSet;
+};
+
+CSavedScheduling::CSavedScheduling(pthread_t handle)
+	: handle{ handle }, policy{ SCHED_OTHER }, param{}
+{
+	pthread_getschedparam(handle, &policy, &param);
+	hasCpuSet = pthread_getaffinity_np(handle, sizeof(cpuSet), &cpuSet) == 0;
+}
+
+CSavedScheduling::~CSavedScheduling()
+{
+	pthread_setschedparam(handle, policy, &param);
+	if(hasCpuSet)
+		pthread_setaffinity_np(handle, sizeof(cpuSet), &cpuSet);
+}
+
+class CDispThread
+{
+public:
+	template<class Display>
+	CDispThread(const SSharedValues<Display>* pSharedValues, const SRealTimeConfig& realTimeConfig);
+	~CDispThread();
+	void SetParked(bool parked) noexcept { control.SetParked(parked); }
+	void Stop() noexcept { control.Finish(); }
+	void RequestBlank(bool isRequested) noexcept { control.RequestBlank(isRequested); }
+	bool IsParked() const noexcept { return control.IsParked(); }
+	uint64_t GetWakeups() const noexcept { return control.GetWakeups(); }
+	uint64_t GetRefreshes() const noexcept { return stats.refreshes.load(memory_order_relaxed); }
+	const SRefreshStats& GetStats() const noexcept { return stats; }
+	pthread_t GetNativeHandle() noexcept { return th.native_handle(); }
+private:
+	CRefreshControl control;
+	SRefreshStats stats;
+	thread th;
+};
+
+template<class Display>
+CDispThread::CDispThread(const SSharedValues<Display>* pSharedValues, const SRealTimeConfig& realTimeConfig)
+	: control{}, th{ DispThread<Display>, &control, &stats, pSharedValues }
+{
+	SetRealTime(th.native_handle(), realTimeConfig);
+}
+
+CDispThread::~CDispThread()
+{
+	control.Finish();
+	th.join();
+}
+
+#if !defined(BOARD_RP1) && !defined(MOCK_GPIO)
+class CMailbox
+{
+public:
+	explicit CMailbox();
+	CMailbox(const CMailbox&) = delete;
+	CMailbox& operator =(const CMailbox&) = delete;
+	~CMailbox();
+	uint32_t Call(uint32_t tag, uint32_t arg0, uint32_t arg1 = 0, uint32_t arg2 = 0);
+
+	struct OpenError {};
+	struct CallError {};
+private:
+	static constexpr int errFD = -1;
+
+	const int fd;
+};
+
+CMailbox::CMailbox()
+	: fd{ open("/dev/vcio", 0) }
+{
+	if(fd == errFD)
+		throw OpenError{};
+}
+
+CMailbox::~CMailbox()
+{
+	close(fd);
+}
+
+uint32_t CMailbox::Call(uint32_t tag, uint32_t arg0, uint32_t arg1, uint32_t arg2)
+{
+	constexpr uint32_t requestCode = 0x00000000;
+	constexpr uint32_t responseOK = 0x80000000;
+	constexpr uint32_t endTag = 0x00000000;
+	constexpr auto ioctlProperty = _IOWR(100, 0, char*);
+
+	alignas(16) uint32_t buffer[] = { 9 * sizeof(uint32_t), requestCode, tag, 3 * sizeof(uint32_t), 3 * sizeof(uint32_t), arg0, arg1, arg2, endTag };
+	if(ioctl(fd, ioctlProperty, buffer) < 0 || buffer[1] != responseOK)
+		throw CallError{};
+	return buffer[5];
+}
+
+class CDmaMemory
+{
+public:
+	explicit CDmaMemory(size_t size);
+	CDmaMemory(const CDmaMemory&) = delete;
+	CDmaMemory& operator =(const CDmaMemory&) = delete;
+	~CDmaMemory();
+	uint8_t* Get() noexcept { return map; }
+	uint32_t GetBusAddress() const noexcept { return busAddress; }
+
+	struct AllocError {};
+private:
+	static constexpr uint32_t tagAlloc = 0x0003000C;
+	static constexpr uint32_t tagLock = 0x0003000D;
+	static constexpr uint32_t tagUnlock = 0x0003000E;
+	static constexpr uint32_t tagRelease = 0x0003000F;
+	static constexpr uint32_t pageSize = 4096;
+	static constexpr uint32_t busToPhys = ~0xC0000000;
+
+	static uint32_t GetAllocFlags();
+	static uint8_t* CreateMap(uint32_t busAddress, size_t size);
+
+	CMailbox mailbox;
+	const size_t size;
+	const uint32_t handle;
+	const uint32_t busAddress;
+	uint8_t* const map;
+};
+
+uint32_t CDmaMemory::GetAllocFlags()
+{
+	constexpr uint32_t memFlagDirect = 1 << 2;
+	constexpr uint32_t memFlagL1Nonallocating = 0b11 << 2;
+	return bcm_host_get_processor_id() == BCM_HOST_PROCESSOR_BCM2835 ? memFlagL1Nonallocating : memFlagDirect;
+}
+
+uint8_t* CDmaMemory::CreateMap(uint32_t busAddress, size_t size)
+{
+	CMemFile memFile;
+	auto map = mmap(NULL,
+	            size,
+	            PROT_READ | PROT_WRITE,
+	            MAP_SHARED,
+	            memFile.GetFD(),
+	            busAddress & busToPhys);
+	if(map == MAP_FAILED)
+		return nullptr;
+	return reinterpret_cast<uint8_t*>(map);
+}
+
+CDmaMemory::CDmaMemory(size_t size)
+	: size{ (size + pageSize - 1) / pageSize * pageSize }
+	, handle{ mailbox.Call(tagAlloc, static_cast<uint32_t>(this->size), pageSize, GetAllocFlags()) }
+	, busAddress{ handle ? mailbox.Call(tagLock, handle) : 0 }
+	, map{ busAddress ? CreateMap(busAddress, this->size) : nullptr }
+{
+	if(map)
+		return;
+	if(busAddress)
+		mailbox.Call(tagUnlock, handle);
+	if(handle)
+		mailbox.Call(tagRelease, handle);
+	throw AllocError{};
+}
+
+CDmaMemory::~CDmaMemory()
+{
+	munmap(map, size);
+	mailbox.Call(tagUnlock, handle);
+	mailbox.Call(tagRelease, handle);
+}
+
+// Goes through the mailbox and /dev/mem the way a DMA display does, so a reload that needs one fails before any teardown.
+void ProbeDma()
+{
+	CDmaMemory probe{ 1 };
+}
+
+class CDmaDisplay
+{
+public:
+	explicit CDmaDisplay(CDisplayGroup& group, int channel, microseconds refreshPeriod);
+	CDmaDisplay(const CDmaDisplay&) = delete;
+	CDmaDisplay& operator =(const CDmaDisplay&) = delete;
+	~CDmaDisplay();
+	template<class WriteFn>
+	void Update(WriteFn&& write, const SBrightness& brightness);
+
+	struct BankError {};
+private:
+	static constexpr int numBuffers = 2;
+	static constexpr int numDigits = CDisplayGroup::numDigits;
+	static constexpr uint32_t pwmClockHz = 10000000;
+	static constexpr uint32_t pwmRange = 10;
+	static constexpr uint32_t maxBlockLength = 65535;		// TXFR_LEN of the DMA Lite channels is 16 bits wide
+public:
+	static constexpr auto maxRefreshPeriod = microseconds{ maxBlockLength / sizeof(uint32_t) / (pwmClockHz / pwmRange / 1000000) };
+	static bool IsSafeChannel(int channel) noexcept;
+private:
+
+	struct SControlBlock
+	{
+		uint32_t ti;
+		uint32_t source;
+		uint32_t dest;
+		uint32_t length;
+		uint32_t stride;
+		uint32_t next;
+		uint32_t reserved[2];
+	};
+
+	struct SBitWords
+	{
+		uint32_t clear;
+		uint32_t set;
+	};
+
+	struct SConstWords
+	{
+		uint32_t sck;
+		uint32_t rck;
+		uint32_t lastDigitsAndSCK[numDigits];
+		uint32_t digits[numDigits];
+		uint32_t hold;
+	};
+
+	int GetNumBlocks() const noexcept;
+	SControlBlock* GetBlocks(int buffer) noexcept;
+	SBitWords* GetBitWords(int buffer) noexcept;
+	SConstWords& GetConstWords() noexcept;
+	uint32_t ToBus(const void* p) noexcept;
+	int GetRunningBuffer() noexcept;
+	void Build(int buffer);
+	void StartClock();
+	void Start();
+	void Stop();
+
+	CDisplayGroup& group;
+	const int numBits;
+	const int channel;
+	const microseconds refreshPeriod;
+	const uint32_t holdWords;
+	const uint32_t blankWords;
+	CMemMap dmaMap;
+	CMemMap pwmMap;
+	CMemMap clockMap;
+	CDmaMemory memory;
+	int activeBuffer;
+	bool running;
+};
+
+int CDmaDisplay::GetNumBlocks() const noexcept
+{
+	constexpr int numSwitchBlocks = 7;
+	return numDigits * (numBits * 3 + numSwitchBlocks);
+}
+
+CDmaDisplay::SControlBlock* CDmaDisplay::GetBlocks(int buffer) noexcept
+{
+	return reinterpret_cast<SControlBlock*>(memory.Get()) + buffer * GetNumBlocks();
+}
+
+CDmaDisplay::SBitWords* CDmaDisplay::GetBitWords(int buffer) noexcept
+{
+	return reinterpret_cast<SBitWords*>(GetBlocks(numBuffers)) + buffer * numDigits * numBits;
+}
+
+CDmaDisplay::SConstWords& CDmaDisplay::GetConstWords() noexcept
+{
+	return *reinterpret_cast<SConstWords*>(GetBitWords(numBuffers));
+}
+
+uint32_t CDmaDisplay::ToBus(const void* p) noexcept
+{
+	auto offset = reinterpret_cast<const uint8_t*>(p) - memory.Get();
+	return memory.GetBusAddress() + static_cast<uint32_t>(offset);
+}
+
+CDmaDisplay::CDmaDisplay(CDisplayGroup& group, int channel, microseconds refreshPeriod)
+	: group{ group }
+	, numBits{ group.GetNumBits() }
+	, channel{ channel }
+	, refreshPeriod{ refreshPeriod }
+	, holdWords{ static_cast<uint32_t>(refreshPeriod.count() * (pwmClockHz / pwmRange / 1000000)) }
+	, blankWords{ max<uint32_t>(1, (g_pinTiming.GetBlankNs() * (pwmClockHz / pwmRange / 1000000) + 999) / 1000) }
+	, dmaMap{ 0x00007000 }
+	, pwmMap{ 0x0020C000 }
+	, clockMap{ 0x00101000 }
+	, memory{ numBuffers * (GetNumBlocks() * sizeof(SControlBlock) + numDigits * numBits * sizeof(SBitWords)) + sizeof(SConstWords) }
+	, activeBuffer{ 0 }
+	, running{ false }
+{
+	if(!group.IsInBank(0))
+		throw BankError{};
+
+	auto& words = GetConstWords();
+	words.sck = group.GetSCK().masks[0];
+	words.rck = group.GetRCK().masks[0];
+	for(int i = 0; i < numDigits; ++i)
+	{
+		auto lastDigitIdx = (i + numDigits - 1) % numDigits;
+		words.lastDigitsAndSCK[i] = words.sck | group.GetDigitMasks(lastDigitIdx).masks[0];
+		words.digits[i] = group.GetDigitMasks(i).masks[0];
+	}
+	words.hold = 0;
+	for(int i = 0; i < numBuffers; ++i)
+		Build(i);
+	StartClock();
+}
+
+// The firmware claims the full channels 0-7 on some releases, and 11-14 are DMA4 engines with another control block
+// layout on BCM2711, which leaves the DMA Lite channels 8-10.
+bool CDmaDisplay::IsSafeChannel(int channel) noexcept
+{
+	return 8 <= channel && channel <= 10;
+}
+
+void CDmaDisplay::Build(int buffer)
+{
+	constexpr uint32_t busGPIO = 0x7E200000;
+	constexpr uint32_t busGPSET0 = busGPIO + 0x1C;
+	constexpr uint32_t busGPCLR0 = busGPIO + 0x28;
+	constexpr uint32_t busPWMFIF1 = 0x7E20C018;
+	constexpr uint32_t tiWaitResp = 1 << 3;
+	constexpr uint32_t tiDestDREQ = 1 << 6;
+	constexpr uint32_t tiPermapPWM = 5 << 16;
+	constexpr uint32_t tiNoWideBursts = 1 << 26;
+	constexpr uint32_t tiStore = tiNoWideBursts | tiWaitResp;
+	constexpr uint32_t tiHold = tiNoWideBursts | tiWaitResp | tiDestDREQ | tiPermapPWM;
+
+	auto blocks = GetBlocks(buffer);
+	auto bitWords = GetBitWords(buffer);
+	auto& words = GetConstWords();
+	auto block = blocks;
+	auto push = [this, &block] (uint32_t ti, const uint32_t* source, uint32_t dest, uint32_t length)
+	{
+		*block = SControlBlock{ ti, ToBus(source), dest, length, 0, ToBus(block + 1), { 0, 0 } };
+		++block;
+	};
+	for(int i = 0; i < numDigits; ++i)
+	{
+		for(int bit = 0; bit < numBits; ++bit)
+		{
+			auto& x = bitWords[i * numBits + bit];
+			x = SBitWords{ 0, 0 };
+			push(tiStore, &x.clear, busGPCLR0, sizeof(uint32_t));
+			push(tiStore, &x.set, busGPSET0, sizeof(uint32_t));
+			push(tiStore, &words.sck, busGPSET0, sizeof(uint32_t));
+		}
+		push(tiStore, &words.lastDigitsAndSCK[i], busGPCLR0, sizeof(uint32_t));
+		push(tiStore, &words.rck, busGPSET0, sizeof(uint32_t));
+		push(tiStore, &words.rck, busGPCLR0, sizeof(uint32_t));
+		push(tiStore, &words.digits[i], busGPSET0, sizeof(uint32_t));
+		push(tiHold, &words.hold, busPWMFIF1, holdWords * sizeof(uint32_t));
+		push(tiStore, &words.digits[i], busGPCLR0, sizeof(uint32_t));
+		push(tiHold, &words.hold, busPWMFIF1, sizeof(uint32_t));
+	}
+	(block - 1)->next = ToBus(blocks);
+}
+
+void CDmaDisplay::StartClock()
+{
+	constexpr uint32_t cmPasswd = 0x5A << 24;
+	constexpr uint32_t cmBusy = 1 << 7;
+	constexpr uint32_t cmEnab = 1 << 4;
+	constexpr uint32_t cmSrcPLLD = 6;
+	constexpr uint32_t CM_PWMCTL = 0xA0;
+	constexpr uint32_t CM_PWMDIV = 0xA4;
+	constexpr uint32_t PWM_CTL = 0x00;
+	constexpr uint32_t PWM_DMAC = 0x08;
+	constexpr uint32_t PWM_RNG1 = 0x10;
+	constexpr uint32_t pwmPWEN1 = 1 << 0;
+	constexpr uint32_t pwmUSEF1 = 1 << 5;
+	constexpr uint32_t pwmCLRF1 = 1 << 6;
+	constexpr uint32_t pwmDmacEnab = 1u << 31;
+	constexpr uint32_t pwmDmacPanic = 7 << 8;
+	constexpr uint32_t pwmDmacDREQ = 3;
+
+	auto plldHz = bcm_host_get_processor_id() == BCM_HOST_PROCESSOR_BCM2711 ? 750000000u : 500000000u;
+
+	StoreRegister(GetAddress(pwmMap.Get(), PWM_CTL), 0);
+	StoreRegister(GetAddress(clockMap.Get(), CM_PWMCTL), cmPasswd | cmSrcPLLD);
+	while(*static_cast<volatile uint32_t*>(GetAddress(clockMap.Get(), CM_PWMCTL)) & cmBusy)
+		this_thread::sleep_for(microseconds{ 10 });
+	StoreRegister(GetAddress(clockMap.Get(), CM_PWMDIV), cmPasswd | ((plldHz / pwmClockHz) << 12));
+	StoreRegister(GetAddress(clockMap.Get(), CM_PWMCTL), cmPasswd | cmSrcPLLD | cmEnab);
+
+	StoreRegister(GetAddress(pwmMap.Get(), PWM_RNG1), pwmRange);
+	StoreRegister(GetAddress(pwmMap.Get(), PWM_DMAC), pwmDmacEnab | pwmDmacPanic | pwmDmacDREQ);
+	StoreRegister(GetAddress(pwmMap.Get(), PWM_CTL), pwmCLRF1);
+	StoreRegister(GetAddress(pwmMap.Get(), PWM_CTL), pwmUSEF1 | pwmPWEN1);
+}
+
+void CDmaDisplay::Start()
+{
+	constexpr uint32_t csActive = 1 << 0;
+	constexpr uint32_t csPriority = 8 << 16;
+	constexpr uint32_t csPanicPriority = 15 << 20;
+	constexpr uint32_t csWaitForWrites = 1 << 28;
+	constexpr uint32_t csReset = 1u << 31;
+
+	auto cs = GetAddress(dmaMap.Get(), channel * 0x100);
+	auto conblkAd = GetAddress(dmaMap.Get(), channel * 0x100 + 0x04);
+	StoreRegister(cs, csReset);
+	this_thread::sleep_for(microseconds{ 10 });
+	StoreRegister(conblkAd, ToBus(GetBlocks(activeBuffer)));
+	StoreRegister(cs, csWaitForWrites | csPanicPriority | csPriority | csActive);
+}
+
+void CDmaDisplay::Stop()
+{
+	constexpr uint32_t csReset = 1u << 31;
+	constexpr uint32_t PWM_CTL = 0x00;
+
+	StoreRegister(GetAddress(dmaMap.Get(), channel * 0x100), csReset);
+	StoreRegister(GetAddress(pwmMap.Get(), PWM_CTL), 0);
+}
+
+int CDmaDisplay::GetRunningBuffer() noexcept
+{
+	auto conblkAd = *static_cast<volatile uint32_t*>(GetAddress(dmaMap.Get(), channel * 0x100 + 0x04));
+	auto offset = conblkAd - memory.GetBusAddress();
+	return static_cast<int>(offset / (GetNumBlocks() * sizeof(SControlBlock)));
+}
+
+template<class WriteFn>
+void CDmaDisplay::Update(WriteFn&& write, const SBrightness& brightness)
+{
+	auto buffer = running ? 1 - activeBuffer : activeBuffer;
+	while(running && GetRunningBuffer() == buffer)
+		this_thread::sleep_for(refreshPeriod);
+
+	auto bitWords = GetBitWords(buffer);
+	auto& words = GetConstWords();
+	auto blocks = GetBlocks(buffer);
+	auto digitBlocks = GetNumBlocks() / numDigits;
+	for(int i = 0; i < numDigits; ++i)
+	{
+		auto onWords = clamp<uint32_t>(holdWords * brightness.duty[i] / fullDuty, 1, holdWords - blankWords);
+		auto hold = blocks + (i + 1) * digitBlocks;
+		(hold - 3)->length = onWords * sizeof(uint32_t);
+		(hold - 1)->length = (holdWords - onWords) * sizeof(uint32_t);
+
+		group.Encode(i, write);
+		for(int bit = 0; bit < numBits; ++bit)
+		{
+			SBankMasks high;
+			SBankMasks low;
+			group.GetBitMasks(bit, high, low);
+			bitWords[i * numBits + bit] = SBitWords{ (bit != 0 ? words.sck : 0) | low.masks[0], high.masks[0] };
+		}
+	}
+
+	if(!running)
+	{
+		Start();
+		running = true;
+		return;
+	}
+	blocks[GetNumBlocks() - 1].next = ToBus(blocks);
+	GetBlocks(activeBuffer)[GetNumBlocks() - 1].next = ToBus(blocks);
+	activeBuffer = buffer;
+}
+
+CDmaDisplay::~CDmaDisplay()
+{
+	Stop();
+}
+
+#endif
+
+static volatile sig_atomic_t g_finished = 0;
+static volatile sig_atomic_t g_dumpStats = 0;
+
+void SigHandler(int sig)
+{
+	g_finished = 1;
+}
+
+static volatile sig_atomic_t g_reload = 0;
+
+void DumpSigHandler(int sig)
+{
+	g_dumpStats = 1;
+}
+
+void ReloadSigHandler(int sig)
+{
+	g_reload = 1;
+}
+
+struct SetSigHandlerFailed { int sig; };
+
+void SetSigHandler(int sig, void (*handler)(int) = SigHandler)
+{
+	struct sigaction action{};
+	action.sa_handler = handler;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(sig, &action, nullptr) != 0)
+		throw SetSigHandlerFailed{ sig };
+}
+
+constexpr const char* defaultTimeZone = "Asia/Tokyo";
+
+void SetTimeZone(const char* timeZone)
+{
+	setenv("TZ", timeZone, 1);
+	tzset();
+}
+
+struct STimeOfDay
+{
+	int hour;
+	int min;
+	int sec;
+};
+
+class CLocalTime
+{
+public:
+	explicit CLocalTime();
+	STimeOfDay Get(time_t t);
+	tm GetCalendar(time_t t);
+	void Reset() noexcept { validFrom = validUntil = 0; }
+private:
+	static constexpr time_t secondsPerDay = 24 * 60 * 60;
+	static constexpr time_t searchStep = secondsPerDay;
+	static constexpr int numSearchSteps = 31;
+
+	static long GetOffset(time_t t);
+	void Update(time_t t);
+
+	long offset;
+	time_t validFrom;
+	time_t validUntil;
+};
+
+CLocalTime::CLocalTime()
+	: offset{ 0 }, validFrom{ 0 }, validUntil{ 0 }
+{
+}
+
+long CLocalTime::GetOffset(time_t t)
+{
+	tm local;
+	localtime_r(&t, &local);
+	return local.tm_gmtoff;
+}
+
+void CLocalTime::Update(time_t t)
+{
+	offset = GetOffset(t);
+	validFrom = t;
+
+	auto lo = t;
+	for(int i = 0; i < numSearchSteps; ++i)
+	{
+		auto hi = lo + searchStep;
+		if(GetOffset(hi) != offset)
+		{
+			while(hi - lo > 1)
+			{
+				auto mid = lo + (hi - lo) / 2;
+				if(GetOffset(mid) == offset)
+					lo = mid;
+				else
+					hi = mid;
+			}
+			validUntil = hi;
+			return;
+		}
+		lo = hi;
+	}
+	validUntil = lo;
+}
+
+STimeOfDay CLocalTime::Get(time_t t)
+{
+	if(t < validFrom || validUntil <= t)
+		Update(t);
+
+	auto secOfDay = static_cast<int>(((t + offset) % secondsPerDay + secondsPerDay) % secondsPerDay);
+	return STimeOfDay{ secOfDay / 3600, secOfDay / 60 % 60, secOfDay % 60 };
+}
+
+// The date comes from the cached offset by plain arithmetic (H. Hinnant's civil_from_days); gmtime_r would take glibc's tz
+// lock on every tick.
+tm CLocalTime::GetCalendar(time_t t)
+{
+	if(t < validFrom || validUntil <= t)
+		Update(t);
+
+	auto local = t + offset;
+	auto days = local / secondsPerDay - (local % secondsPerDay < 0);
+	auto secOfDay = static_cast<int>(local - days * secondsPerDay);
+
+	auto z = days + 719468;
+	auto era = (z >= 0 ? z : z - 146096) / 146097;
+	auto dayOfEra = z - era * 146097;
+	auto yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+	auto dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);		// counted from March 1st
+	auto mp = (5 * dayOfYear + 2) / 153;
+	auto month = mp < 10 ? mp + 3 : mp - 9;
+	auto year = yearOfEra + era * 400 + (month <= 2);
+	auto isLeap = year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+
+	tm ret{};
+	ret.tm_sec = secOfDay % 60;
+	ret.tm_min = secOfDay / 60 % 60;
+	ret.tm_hour = secOfDay / 3600;
+	ret.tm_mday = static_cast<int>(dayOfYear - (153 * mp + 2) / 5 + 1);
+	ret.tm_mon = static_cast<int>(month - 1);
+	ret.tm_year = static_cast<int>(year - 1900);
+	ret.tm_wday = static_cast<int>(((days + 4) % 7 + 7) % 7);		// 1970-01-01 was a Thursday
+	ret.tm_yday = static_cast<int>(mp < 10 ? dayOfYear + 59 + isLeap : dayOfYear - 306);
+	ret.tm_gmtoff = offset;
+	return ret;
+}
+
+enum EMode : uint8_t
+{
+	ModeClock,
+	ModeMinSec,
+	ModeDate,
+	ModeYear,
+	ModeCountdown,
+	ModeStopwatch,
+	numModes,
+};
+
+constexpr const char* modeNames[numModes] = { "clock", "minsec", "date", "year", "countdown", "stopwatch" };
+
+struct SModeStep
+{
+	EMode mode;
+	seconds duration;
+};
+
+struct SSourceContext
+{
+	const tm& local;
+	steady_clock::time_point now;
+	steady_clock::time_point countdownEnd;
+	const CStopwatch& stopwatch;
+};
+
+SMyValue GetClockValue(const SSourceContext& context)
+{
+	return SMyValue
+	{
+		CreateValue4(CreateValue2(context.local.tm_hour), CreateValue2(context.local.tm_min)),
+		(context.local.tm_sec % 2) != 0,
+	};
+}
+
+SMyValue GetMinSecValue(const SSourceContext& context)
+{
+	return SMyValue{ CreateValue4(CreateValue2(context.local.tm_min), CreateValue2(context.local.tm_sec)), true };
+}
+
+SMyValue GetDateValue(const SSourceContext& context)
+{
+	return SMyValue{ CreateValue4(CreateValue2(context.local.tm_mon + 1), CreateValue2(context.local.tm_mday)), true };
+}
+
+SMyValue GetYearValue(const SSourceContext& context)
+{
+	auto year = context.local.tm_year + 1900;
+	return SMyValue{ CreateValue4(CreateValue2(year / 100 % 100), CreateValue2(year % 100)), false };
+}
+
+// MM.SS while under 100 minutes, HH.MM above; the point blinks once it reaches zero.
+SMyValue GetCountdownValue(const SSourceContext& context)
+{
+	auto left = static_cast<int>(duration_cast<seconds>(max(context.countdownEnd - context.now, steady_clock::duration::zero()) + seconds{ 1 } - nanoseconds{ 1 }).count());
+	if(left >= 100 * 60)
+		return SMyValue{ CreateValue4(CreateValue2(left / 3600 % 100), CreateValue2(left / 60 % 60)), true };
+	return SMyValue{ CreateValue4(CreateValue2(left / 60), CreateValue2(left % 60)), left != 0 || (context.local.tm_sec % 2) != 0 };
+}
+
+SMyValue GetStopwatchValue(const SSourceContext& context)
+{
+	return context.stopwatch.Get(context.now);
+}
+
+using ValueSource = SMyValue (*)(const SSourceContext& context);
+
+constexpr ValueSource valueSources[numModes] = { GetClockValue, GetMinSecValue, GetDateValue, GetYearValue, GetCountdownValue, GetStopwatchValue };
+
+class CModeScheduler
+{
+public:
+	explicit CModeScheduler(const vector<SModeStep>& rotation);
+	EMode Get(steady_clock::time_point now) const noexcept;
+	SMyValue GetValue(CLocalTime& localTime, steady_clock::time_point now) const;
+	void SetRotation(const vector<SModeStep>& rotation);
+	void Select(EMode mode) noexcept { selected = mode; }
+	void SelectRotation() noexcept { selected = numModes; }
+	void StartCountdown(seconds duration, steady_clock::time_point now) noexcept { countdownEnd = now + duration; }
+	CStopwatch& GetStopwatch() noexcept { return stopwatch; }
+private:
+	vector<SModeStep> rotation;
+	const steady_clock::time_point start;
+	seconds period;
+	EMode selected;
+	steady_clock::time_point countdownEnd;
+	CStopwatch stopwatch;
+};
+
+CModeScheduler::CModeScheduler(const vector<SModeStep>& rotation)
+	: start{ steady_clock::now() }
+	, period{ 0 }
+	, selected{ numModes }
+	, countdownEnd{ start }
+{
+	SetRotation(rotation);
+}
+
+void CModeScheduler::SetRotation(const vector<SModeStep>& rotation)
+{
+	this->rotation = rotation;
+	period = seconds{ 0 };
+	for(auto& x : rotation)
+		period += x.duration;
+}
+
+EMode CModeScheduler::Get(steady_clock::time_point now) const noexcept
+{
+	if(selected != numModes)
+		return selected;
+	if(rotation.empty())
+		return ModeClock;
+	if(period == seconds::zero())
+		return rotation.front().mode;
+
+	auto pos = duration_cast<seconds>(now - start) % period;
+	for(auto& x : rotation)
+	{
+		if(pos < x.duration)
+			return x.mode;
+		pos -= x.duration;
+	}
+	return rotation.back().mode;
+}
+
+SMyValue CModeScheduler::GetValue(CLocalTime& localTime, steady_clock::time_point now) const
+{
+	auto local = localTime.GetCalendar(time(nullptr));
+	return valueSources[Get(now)](SSourceContext{ local, now, countdownEnd, stopwatch });
+}
+
+constexpr int minDuty = 5;
+constexpr SBrightness idleBrightness{ { minDuty, minDuty, minDuty, minDuty } };
+
+class CDimmer
+{
+public:
+	explicit CDimmer(const SBrightness& base, const char* sensorPath, int sensorFull);
+	CDimmer(const CDimmer&) = delete;
+	CDimmer& operator =(const CDimmer&) = delete;
+	~CDimmer();
+	SBrightness Get() const;
+
+	struct SensorError {};
+private:
+	static constexpr int errFD = -1;
+
+	int ReadPercent() const;
+
+	const SBrightness base;
+	const int fd;
+	const int sensorFull;
+};
+
+CDimmer::CDimmer(const SBrightness& base, const char* sensorPath, int sensorFull)
+	: base{ base }, fd{ sensorPath ? open(sensorPath, O_RDONLY | O_CLOEXEC) : errFD }, sensorFull{ sensorFull }
+{
+	if(sensorPath && (fd == errFD || sensorFull <= 0))
+		throw SensorError{};
+}
+
+CDimmer::~CDimmer()
+{
+	if(fd != errFD)
+		close(fd);
+}
+
+int CDimmer::ReadPercent() const
+{
+	if(fd == errFD)
+		return fullDuty;
+	char buf[32];
+	auto n = pread(fd, buf, sizeof(buf) - 1, 0);
+	if(n <= 0)
+		return fullDuty;
+	buf[n] = '\0';
+	return static_cast<int>(clamp<long>(atol(buf) * fullDuty / sensorFull, 0, fullDuty));
+}
+
+SBrightness CDimmer::Get() const
+{
+	auto percent = ReadPercent();
+	SBrightness ret;
+	for(int i = 0; i < C4Digits::numDigits; ++i)
+		ret.duty[i] = static_cast<uint8_t>(clamp(base.duty[i] * percent / fullDuty, minDuty, static_cast<int>(fullDuty)));
+	return ret;
+}
+
+enum EIdleMode
+{
+	IdleBlank,
+	IdleDim,
+};
+
+struct SIdleSchedule
+{
+	bool enabled;
+	int fromMin;
+	int untilMin;
+	EIdleMode mode;
+
+	bool IsIdle(const STimeOfDay& time) const noexcept;
+};
+
+constexpr SIdleSchedule defaultIdleSchedule{ false, 0, 0, IdleBlank };
+
+bool SIdleSchedule::IsIdle(const STimeOfDay& time) const noexcept
+{
+	if(!enabled)
+		return false;
+	auto min = time.hour * 60 + time.min;
+	if(fromMin <= untilMin)
+		return fromMin <= min && min < untilMin;
+	return fromMin <= min || min < untilMin;
+}
+
+constexpr SChainPins defaultChainPins{ 21, 20, 16, { 26, 19, 13, 6 } };
+
+using CDefaultDisplay = CStaticDisplay<
+	defaultChainPins.siID, defaultChainPins.rckID, defaultChainPins.sckID,
+	defaultChainPins.digitIDs[0], defaultChainPins.digitIDs[1], defaultChainPins.digitIDs[2], defaultChainPins.digitIDs[3]>;
+
+
+constexpr int noDmaChannel = -1;
+constexpr auto defaultTraceDuration = seconds{ 10 };
+
+enum EEngine
+{
+	EngineThreads,
+	EngineSingle,
+};
+
+struct SOptions
+{
+	SRealTimeConfig realTime;
+	vector<SChainPins> chains;
+	int dmaChannel;
+	const char* gpioDevice;
+	SBrightness brightness;
+	const char* sensorPath;
+	int sensorFull;
+	microseconds refreshPeriod;
+	SIdleSchedule idle;
+	const char* statsPath;
+	bool benchmark;
+	const char* tracePath;
+	seconds traceDuration;
+	SPinTimingNs pinTiming;
+	const char* contentPath;
+	vector<SModeStep> modes;
+	const char* configPath;
+	const char* timeZone;
+	EEngine engine;
+	const char* profilePath;
+	int maxSegments;
+};
+
+struct InvalidOption {};
+
+SChainPins ParseChainPins(const char* str)
+{
+	SChainPins ret{ noPin, noPin, noPin, { noPin, noPin, noPin, noPin } };
+	auto& d = ret.digitIDs;
+	int pinsEnd = 0, digitsEnd = 0;
+	auto n = sscanf(str, "%d,%d,%d%n,%d,%d,%d,%d%n", &ret.siID, &ret.rckID, &ret.sckID, &pinsEnd, &d[0], &d[1], &d[2], &d[3], &digitsEnd);
+	if((n != 3 && n != 7) || str[n == 3 ? pinsEnd : digitsEnd] != '\0')
+		throw InvalidOption{};
+	for(auto id : { ret.siID, ret.rckID, ret.sckID })
+	{
+		if(GetBank(id) == -1)
+			throw InvalidOption{};
+	}
+	for(int i = 0; n == 7 && i < C4Digits::numDigits; ++i)
+	{
+		if(GetBank(d[i]) == -1)
+			throw InvalidOption{};
+	}
+	return ret;
+}
+
+SBrightness ParseBrightness(const char* str)
+{
+	int d[C4Digits::numDigits];
+	char tail;
+	auto n = sscanf(str, "%d,%d,%d,%d%c", &d[0], &d[1], &d[2], &d[3], &tail);
+	if(n == 1)
+		d[1] = d[2] = d[3] = d[0];
+	else if(n != C4Digits::numDigits)
+		throw InvalidOption{};
+	SBrightness ret;
+	for(int i = 0; i < C4Digits::numDigits; ++i)
+	{
+		if(d[i] <= 0 || fullDuty < d[i])
+			throw InvalidOption{};
+		ret.duty[i] = static_cast<uint8_t>(d[i]);
+	}
+	return ret;
+}
+
+void ParseSensor(char* str, SOptions& options)
+{
+	auto comma = strrchr(str, ',');
+	if(!comma)
+		throw InvalidOption{};
+	*comma = '\0';
+	options.sensorPath = str;
+	options.sensorFull = atoi(comma + 1);
+	if(options.sensorFull <= 0)
+		throw InvalidOption{};
+}
+
+microseconds ParseRefreshPeriod(const char* str)
+{
+	auto period = microseconds{ atoi(str) };
+	if(period < minRefreshPeriod || maxRefreshPeriod < period)
+		throw InvalidOption{};
+	return period;
+}
+
+void ParseIdleHours(const char* str, SIdleSchedule& idle)
+{
+	int fromHour, fromMin, untilHour, untilMin;
+	char tail;
+	if(sscanf(str, "%d:%d-%d:%d%c", &fromHour, &fromMin, &untilHour, &untilMin, &tail) != 4)
+		throw InvalidOption{};
+	auto isValid = [] (int hour, int min) { return 0 <= hour && hour < 24 && 0 <= min && min < 60; };
+	if(!isValid(fromHour, fromMin) || !isValid(untilHour, untilMin))
+		throw InvalidOption{};
+	idle.enabled = true;
+	idle.fromMin = fromHour * 60 + fromMin;
+	idle.untilMin = untilHour * 60 + untilMin;
+}
+
+EMode ParseMode(string_view str)
+{
+	for(int i = 0; i < numModes; ++i)
+	{
+		if(str == modeNames[i])
+			return static_cast<EMode>(i);
+	}
+	throw InvalidOption{};
+}
+
+vector<SModeStep> ParseModes(const char* str)
+{
+	vector<SModeStep> ret;
+	string_view rest{ str };
+	while(!rest.empty())
+	{
+		auto item = rest.substr(0, rest.find(','));
+		rest.remove_prefix(min(rest.size(), item.size() + 1));
+		auto colon = item.find(':');
+		auto duration = seconds{ 0 };
+		if(colon != string_view::npos)
+		{
+			int secs;
+			char tail;
+			if(sscanf(string{ item.substr(colon + 1) }.c_str(), "%d%c", &secs, &tail) != 1 || secs <= 0)
+				throw InvalidOption{};
+			duration = seconds{ secs };
+		}
+		ret.push_back(SModeStep{ ParseMode(item.substr(0, colon)), duration });
+	}
+	if(ret.empty() || (ret.size() > 1 && any_of(ret.begin(), ret.end(), [] (const SModeStep& x) { return x.duration == seconds::zero(); })))
+		throw InvalidOption{};
+	return ret;
+}
+
+EEngine ParseEngine(string_view str)
+{
+	if(str == "threads")
+		return EngineThreads;
+	if(str == "single")
+		return EngineSingle;
+	throw InvalidOption{};
+}
+
+EIdleMode ParseIdleMode(string_view str)
+{
+	if(str == "blank")
+		return IdleBlank;
+	if(str == "dim")
+		return IdleDim;
+	throw InvalidOption{};
+}
+
+void ParseTrace(char* str, SOptions& options)
+{
+	options.tracePath = str;
+	auto comma = strrchr(str, ',');
+	if(!comma)
+		return;
+	*comma = '\0';
+	options.traceDuration = seconds{ atoi(comma + 1) };
+	if(options.traceDuration <= seconds{ 0 })
+		throw InvalidOption{};
+}
+
+SPinTimingNs ParsePinTiming(const char* str)
+{
+	int high, low, setup;
+	char tail;
+	if(sscanf(str, "%d,%d,%d%c", &high, &low, &setup, &tail) != 3 || high < 0 || low < 0 || setup < 0)
+		throw InvalidOption{};
+	return SPinTimingNs{ static_cast<uint32_t>(high), static_cast<uint32_t>(low), static_cast<uint32_t>(setup), 0 };
+}
+
+uint32_t ParseBlankNs(const char* str)
+{
+	auto ns = atoi(str);
+	if(ns < 0 || duration_cast<nanoseconds>(minRefreshPeriod).count() / 2 < ns)
+		throw InvalidOption{};
+	return static_cast<uint32_t>(ns);
+}
+
+#if !defined(BOARD_RP1) && !defined(MOCK_GPIO)
+int ParseDmaChannel(const char* str)
+{
+	auto channel = atoi(str);
+	if(!CDmaDisplay::IsSafeChannel(channel))
+		throw InvalidOption{};
+	return channel;
+}
+#endif
+
+int ParseMaxSegments(const char* str)
+{
+	auto n = atoi(str);
+	if(n <= 0)
+		throw InvalidOption{};
+	return n;
+}
+
+SOptions ParseOptions(int argc, char* argv[])
+{
+	auto ret = SOptions{ defaultRealTimeConfig, {}, noDmaChannel, CGPIOPort::defaultDevice, fullBrightness, nullptr, 0, defaultRefreshPeriod, defaultIdleSchedule, nullptr, false, nullptr, defaultTraceDuration, {}, nullptr, {}, nullptr, defaultTimeZone, EngineThreads, nullptr, noCurrentLimit };
+	int opt;
+	optind = 0;		// glibc fully re-initializes getopt on 0, so a reload can parse again
+	while((opt = getopt(argc, argv, "rp:a:d:D:g:b:l:f:o:m:S:Bt:w:k:c:M:C:z:e:P:E:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'E': ret.maxSegments = ParseMaxSegments(optarg); break;
+		case 'P': ret.profilePath = optarg; break;
+		case 'e': ret.engine = ParseEngine(optarg); break;
+		case 'C': ret.configPath = optarg; break;
+		case 'z': ret.timeZone = optarg; break;
+		case 'M': ret.modes = ParseModes(optarg); break;
+		case 'c': ret.contentPath = optarg; break;
+		case 'w':
+		{
+			auto blank = ret.pinTiming.blank;
+			ret.pinTiming = ParsePinTiming(optarg);
+			ret.pinTiming.blank = blank;
+			break;
+		}
+		case 'k': ret.pinTiming.blank = ParseBlankNs(optarg); break;
+		case 't': ParseTrace(optarg, ret); break;
+#ifdef MOCK_GPIO
+		case 'B': ret.benchmark = true; break;
+#endif
+		case 'S': ret.statsPath = optarg; break;
+		case 'f': ret.refreshPeriod = ParseRefreshPeriod(optarg); break;
+		case 'o': ParseIdleHours(optarg, ret.idle); break;
+		case 'm': ret.idle.mode = ParseIdleMode(optarg); break;
+		case 'b': ret.brightness = ParseBrightness(optarg); break;
+		case 'l': ParseSensor(optarg, ret); break;
+		case 'g': ret.gpioDevice = optarg; break;
+#if !defined(BOARD_RP1) && !defined(MOCK_GPIO)
+		case 'D': ret.dmaChannel = ParseDmaChannel(optarg); break;
+#endif
+		case 'd': ret.chains.push_back(ParseChainPins(optarg)); break;
+		case 'r': ret.realTime.enabled = true; break;
+		case 'p': ret.realTime.priority = atoi(optarg); break;
+		case 'a': ret.realTime.cpu = atoi(optarg); break;
+		default: throw InvalidOption{};
+		}
+	}
+	// The DMA ring dims by clearing digit lines during the hold, which cascaded digit selects do not have.
+	auto isCascaded = any_of(ret.chains.begin(), ret.chains.end(), HasCascadedDigitSelect);
+	auto isDimmed = !(ret.brightness == fullBrightness) || ret.sensorPath || (ret.idle.enabled && ret.idle.mode == IdleDim)
+		|| ret.maxSegments != noCurrentLimit;
+	if(ret.dmaChannel != noDmaChannel && isCascaded && isDimmed)
+		throw InvalidOption{};
+#if !defined(BOARD_RP1) && !defined(MOCK_GPIO)
+	if(ret.dmaChannel != noDmaChannel && CDmaDisplay::maxRefreshPeriod < ret.refreshPeriod)
+		throw InvalidOption{};
+#endif
+	return ret;
+}
+
+struct ConfigError {};
+
+vector<string> ReadConfigFile(const char* path)
+{
+	auto fp = fopen(path, "r");
+	if(!fp)
+		throw ConfigError{};
+	vector<string> ret;
+	char line[1024];
+	while(fgets(line, sizeof(line), fp))
+	{
+		*strchrnul(line, '#') = '\0';
+		char* save;
+		for(auto token = strtok_r(line, " \t\r\n", &save); token; token = strtok_r(nullptr, " \t\r\n", &save))
+			ret.push_back(token);
+	}
+	fclose(fp);
+	return ret;
+}
+
+// SOptions points into args, and parsing edits the tokens in place, so each load parses its own copy of them.
+struct SConfig
+{
+	int argc;
+	char** argv;
+	vector<string> args;
+	SOptions options;
+};
+
+SOptions ParseArgs(char* program, vector<string>& args)
+{
+	vector<char*> argv{ program };
+	for(auto& x : args)
+		argv.push_back(x.data());
+	argv.push_back(nullptr);
+	return ParseOptions(static_cast<int>(argv.size() - 1), argv.data());
+}
+
+// The -C file holds options in command-line syntax. They are parsed first, so an option on the actual command line overrides
+// the file's. -d repeats instead, so any -d on the command line replaces all of the file's chains rather than adding to them.
+unique_ptr<SConfig> LoadConfig(int argc, char* argv[])
+{
+	vector<string> commandLine{ argv + 1, argv + argc };
+	auto ret = make_unique<SConfig>(SConfig{ argc, argv, commandLine, {} });
+	ret->options = ParseArgs(argv[0], ret->args);
+	if(!ret->options.configPath)
+		return ret;
+
+	auto chains = ret->options.chains;
+	ret->args = ReadConfigFile(string{ ret->options.configPath }.c_str());
+	ret->args.insert(ret->args.end(), commandLine.begin(), commandLine.end());
+	ret->options = ParseArgs(argv[0], ret->args);
+	if(!chains.empty())
+		ret->options.chains = move(chains);
+	return ret;
+}
+
+enum ERebuild
+{
+	RebuildNone,
+	RebuildThread,
+	RebuildEngine,
+	RebuildDisplay,
+};
+
+bool IsSamePath(const char* a, const char* b)
+{
+	return a && b ? strcmp(a, b) == 0 : a == b;
+}
+
+bool IsTraceChanged(const SOptions& cur, const SOptions& next)
+{
+	return !IsSamePath(cur.tracePath, next.tracePath) || cur.traceDuration != next.traceDuration;
+}
+
+// Only pin and device changes remap GPIO; an engine change keeps the displays, and a new trace is attached to the running port
+// while the refresh thread restarts.
+ERebuild GetRebuild(const SOptions& cur, const SOptions& next)
+{
+	if(cur.chains != next.chains || cur.dmaChannel != next.dmaChannel || !IsSamePath(cur.gpioDevice, next.gpioDevice))
+		return RebuildDisplay;
+	if(cur.engine != next.engine)
+		return RebuildEngine;
+	if(cur.refreshPeriod != next.refreshPeriod || !(cur.realTime == next.realTime) || !(cur.pinTiming == next.pinTiming) || cur.maxSegments != next.maxSegments
+		|| IsTraceChanged(cur, next))
+		return RebuildThread;
+	return RebuildNone;
+}
+
+vector<SChainPins> GetChains(const SOptions& options)
+{
+	return options.chains.empty() ? vector<SChainPins>{ defaultChainPins } : options.chains;
+}
+
+// Two displays can run side by side only on separate pins, and only one of them can own the DMA channel and the PWM.
+bool CanOverlap(const SOptions& cur, const SOptions& next)
+{
+	if(cur.dmaChannel != noDmaChannel || next.dmaChannel != noDmaChannel)
+		return false;
+	auto getPins = [] (const SOptions& options)
+	{
+		SBankMasks ret{};
+		for(auto& x : GetChains(options))
+		{
+			for(auto id : { x.siID, x.rckID, x.sckID })
+				AddToMasks(ret, id);
+			for(auto id : x.digitIDs)
+				AddToMasks(ret, id);
+		}
+		return ret;
+	};
+	auto curPins = getPins(cur);
+	auto nextPins = getPins(next);
+	for(int i = 0; i < numBanks; ++i)
+	{
+		if(curPins.masks[i] & nextPins.masks[i])
+			return false;
+	}
+	return true;
+}
+
+class CSecondTimer
+{
+public:
+	explicit CSecondTimer();
+	CSecondTimer(const CSecondTimer&) = delete;
+	CSecondTimer& operator =(const CSecondTimer&) = delete;
+	~CSecondTimer();
+	int GetFD() const noexcept { return fd; }
+	bool Wait();
+
+	struct CreateError {};
+private:
+	static constexpr int errFD = -1;
+
+	void Arm();
+
+	const int fd;
+};
+
+CSecondTimer::CSecondTimer()
+	: fd{ timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC) }
+{
+	if(fd == errFD)
+		throw CreateError{};
+	Arm();
+}
+
+CSecondTimer::~CSecondTimer()
+{
+	close(fd);
+}
+
+void CSecondTimer::Arm()
+{
+	timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	itimerspec spec{ { 1, 0 }, { now.tv_sec + 1, 0 } };
+	if(timerfd_settime(fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, nullptr) != 0)
+		throw CreateError{};
+}
+
+// Returns true when the wall clock was stepped, e.g. by the first NTP sync.
+bool CSecondTimer::Wait()
+{
+	uint64_t expirations;
+	if(read(fd, &expirations, sizeof(expirations)) < 0 && errno == ECANCELED)
+	{
+		Arm();
+		return true;
+	}
+	return false;
+}
+
+// Speaks the sd_notify datagram protocol directly; every call is a no-op outside a Type=notify unit.
+class CServiceNotifier
+{
+public:
+	explicit CServiceNotifier();
+	CServiceNotifier(const CServiceNotifier&) = delete;
+	CServiceNotifier& operator =(const CServiceNotifier&) = delete;
+	~CServiceNotifier();
+	bool HasWatchdog() const noexcept { return hasWatchdog; }
+	void Notify(const char* state) noexcept;
+private:
+	static constexpr int errFD = -1;
+
+	int fd;
+	sockaddr_un addr;
+	socklen_t addrLength;
+	bool hasWatchdog;
+};
+
+CServiceNotifier::CServiceNotifier()
+	: fd{ errFD }, addr{}, addrLength{ 0 }, hasWatchdog{ false }
+{
+	auto path = getenv("NOTIFY_SOCKET");
+	if(!path || (path[0] != '/' && path[0] != '@') || strlen(path) >= sizeof(addr.sun_path))
+		return;
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if(path[0] == '@')
+		addr.sun_path[0] = '\0';
+	addrLength = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + strlen(path));
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	auto pid = getenv("WATCHDOG_PID");
+	hasWatchdog = getenv("WATCHDOG_USEC") && (!pid || atoi(pid) == getpid());
+}
+
+CServiceNotifier::~CServiceNotifier()
+{
+	if(fd != errFD)
+		close(fd);
+}
+
+void CServiceNotifier::Notify(const char* state) noexcept
+{
+	if(fd != errFD)
+		sendto(fd, state, strlen(state), MSG_DONTWAIT | MSG_NOSIGNAL, reinterpret_cast<const sockaddr*>(&addr), addrLength);
+}
+
+static CServiceNotifier g_notifier;
+
+// Holding back the ping while refreshing has stalled lets systemd restart us; the digits are blanked first so none
+// stays lit at full current in the meantime.
+class CRefreshWatchdog
+{
+public:
+	explicit CRefreshWatchdog();
+	bool Check(uint64_t refreshes, bool isParked) noexcept;
+	bool IsStalled() const noexcept { return stalledTicks >= stallTicks; }
+private:
+	static constexpr int stallTicks = 2;
+
+	uint64_t lastRefreshes;
+	int stalledTicks;
+};
+
+CRefreshWatchdog::CRefreshWatchdog()
+	: lastRefreshes{ 0 }, stalledTicks{ 0 }
+{
+}
+
+// Returns true on the tick the refresh thread is first found stalled.
+bool CRefreshWatchdog::Check(uint64_t refreshes, bool isParked) noexcept
+{
+	if(isParked || refreshes != lastRefreshes)
+	{
+		lastRefreshes = refreshes;
+		stalledTicks = 0;
+		if(g_notifier.HasWatchdog())
+			g_notifier.Notify("WATCHDOG=1");
+		return false;
+	}
+	return ++stalledTicks == stallTicks;
+}
+
+// The kernel's NTP status tells whether timesyncd has disciplined the clock yet.
+class CTimeSync
+{
+public:
+	explicit CTimeSync();
+	bool IsSynced() const noexcept { return synced; }
+	void Update(bool wasClockSet) noexcept;
+private:
+	static constexpr int syncedCheckPeriod = 64;
+
+	static bool Query() noexcept;
+
+	bool synced;
+	int ticks;
+};
+
+CTimeSync::CTimeSync()
+	: synced{ Query() }, ticks{ 0 }
+{
+}
+
+bool CTimeSync::Query() noexcept
+{
+	timex tx{};
+	auto state = adjtimex(&tx);
+	return state != -1 && state != TIME_ERROR && !(tx.status & STA_UNSYNC);
+}
+
+void CTimeSync::Update(bool wasClockSet) noexcept
+{
+	if(wasClockSet || !synced || ++ticks == syncedCheckPeriod)
+	{
+		synced = Query();
+		ticks = 0;
+	}
+}
+
+class CPoller
+{
+public:
+	explicit CPoller();
+	CPoller(const CPoller&) = delete;
+	CPoller& operator =(const CPoller&) = delete;
+	~CPoller();
+	void Add(int fd, uint32_t tag);
+	uint32_t Wait(int timeoutMs);
+
+	struct CreateError {};
+private:
+	static constexpr int errFD = -1;
+	static constexpr int maxEvents = 4;
+
+	const int fd;
+};
+
+CPoller::CPoller()
+	: fd{ epoll_create1(EPOLL_CLOEXEC) }
+{
+	if(fd == errFD)
+		throw CreateError{};
+}
+
+CPoller::~CPoller()
+{
+	close(fd);
+}
+
+void CPoller::Add(int target, uint32_t tag)
+{
+	epoll_event event{};
+	event.events = EPOLLIN;
+	event.data.u32 = tag;
+	if(epoll_ctl(fd, EPOLL_CTL_ADD, target, &event) != 0)
+		throw CreateError{};
+}
+
+uint32_t CPoller::Wait(int timeoutMs)
+{
+	epoll_event events[maxEvents];
+	auto n = epoll_wait(fd, events, maxEvents, timeoutMs);
+	uint32_t ret = 0;
+	for(int i = 0; i < n; ++i)
+		ret |= events[i].data.u32;
+	return ret;
+}
+
+class CContentServer
+{
+public:
+	explicit CContentServer(const char* path);
+	CContentServer(const CContentServer&) = delete;
+	CContentServer& operator =(const CContentServer&) = delete;
+	~CContentServer();
+	int GetFD() const noexcept { return fd; }
+	void SetFrameRing(const CFrameRing* ring) noexcept { this->ring = ring; }
+	void SetModeScheduler(CModeScheduler* modes) noexcept { this->modes = modes; }
+	bool Receive(steady_clock::time_point now);
+	const SFrame* GetFrame(steady_clock::time_point now) const noexcept;
+	int GetTimeoutMs(steady_clock::time_point now) const noexcept;
+
+	struct OpenError {};
+private:
+	static constexpr int errFD = -1;
+	static constexpr int numOverlays = 8;
+	static constexpr int defaultPriority = 1;
+	static constexpr int defaultTimeoutMs = 10000;
+	static constexpr size_t maxMessageSize = 128;
+	static constexpr auto scrollPeriod = milliseconds{ 300 };
+
+	struct SOverlay
+	{
+		bool active;
+		uint8_t priority;
+		steady_clock::time_point start;
+		steady_clock::time_point until;
+		CScrollText text;
+	};
+
+	void Parse(const char* message, steady_clock::time_point now, const sockaddr_un& sender, socklen_t senderLength);
+	void SendFrameRing(const sockaddr_un& sender, socklen_t senderLength);
+	void Put(int priority, int timeoutMs, CScrollText&& text, steady_clock::time_point now);
+	void Remove(int priority);
+	void Control(const char* command, const char* arg, steady_clock::time_point now);
+
+	const string path;
+	const int fd;
+	SOverlay overlays[numOverlays];
+	const CFrameRing* ring;
+	CModeScheduler* modes;
+};
+
+CContentServer::CContentServer(const char* path)
+	: path{ path }
+	, fd{ socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0) }
+	, overlays{}
+	, ring{ nullptr }
+	, modes{ nullptr }
+{
+	if(fd == errFD)
+		throw OpenError{};
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	if(this->path.size() >= sizeof(addr.sun_path))
+	{
+		close(fd);
+		throw OpenError{};
+	}
+	this->path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	if(bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0)
+	{
+		close(fd);
+		throw OpenError{};
+	}
+}
+
+CContentServer::~CContentServer()
+{
+	close(fd);
+	unlink(path.c_str());
+}
+
+// Returns whether any message arrived.
+bool CContentServer::Receive(steady_clock::time_point now)
+{
+	char message[maxMessageSize + 1];
+	sockaddr_un sender;
+	socklen_t senderLength = sizeof(sender);
+	ssize_t n;
+	auto ret = false;
+	while((n = recvfrom(fd, message, maxMessageSize, 0, reinterpret_cast<sockaddr*>(&sender), &senderLength)) >= 0)
+	{
+		message[n] = '\0';
+		Parse(message, now, sender, senderLength);
+		senderLength = sizeof(sender);
+		ret = true;
+	}
+	return ret;
+}
+
+void CContentServer::SendFrameRing(const sockaddr_un& sender, socklen_t senderLength)
+{
+	if(!ring || senderLength <= sizeof(sa_family_t))
+		return;
+	char reply[] = "ring";
+	iovec iov{ reply, sizeof(reply) - 1 };
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+	msghdr msg{};
+	msg.msg_name = const_cast<sockaddr_un*>(&sender);
+	msg.msg_namelen = senderLength;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	auto cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	auto ringFD = ring->GetFD();
+	memcpy(CMSG_DATA(cmsg), &ringFD, sizeof(ringFD));
+	sendmsg(fd, &msg, MSG_DONTWAIT);
+}
+
+void CContentServer::Parse(const char* message, steady_clock::time_point now, const sockaddr_un& sender, socklen_t senderLength)
+{
+	unsigned int value4, points = 0;
+	int priority = defaultPriority, timeoutMs = defaultTimeoutMs;
+	unsigned int segments[C4Digits::numDigits];
+	int textPos = 0;
+	char command[16], arg[16];
+	if(sscanf(message, "hex %4x %x %d %d", &value4, &points, &priority, &timeoutMs) >= 1)
+	{
+		SFrame frame;
+		for(int i = 0; i < C4Digits::numDigits; ++i)
+			frame.segments[i] = Get7SegBitsWithPoint(GetDigit(static_cast<uint16_t>(value4), i), (points >> i) & 0b1);
+		Put(priority, timeoutMs, CScrollText{ frame }, now);
+	}
+	else if(sscanf(message, "seg %x %x %x %x %d %d", &segments[0], &segments[1], &segments[2], &segments[3], &priority, &timeoutMs) >= 4)
+	{
+		SFrame frame;
+		for(int i = 0; i < C4Digits::numDigits; ++i)
+			frame.segments[i] = static_cast<uint8_t>(segments[i]);
+		Put(priority, timeoutMs, CScrollText{ frame }, now);
+	}
+	else if(sscanf(message, "text %d %d %n", &priority, &timeoutMs, &textPos) == 2 && textPos > 0)
+		Put(priority, timeoutMs, CScrollText{ string_view{ message + textPos } }, now);
+	else if(string_view{ message }.starts_with("ring"))
+		SendFrameRing(sender, senderLength);
+	else if(string_view{ message }.starts_with("clear"))
+	{
+		sscanf(message, "clear %d", &priority);
+		Remove(priority);
+	}
+	else if(sscanf(message, "%15s %15s", command, arg) == 2 && modes)
+		Control(command, arg, now);
+}
+
+void CContentServer::Control(const char* command, const char* arg, steady_clock::time_point now)
+{
+	string_view cmd{ command }, value{ arg };
+	int secs;
+	if(cmd == "mode" && value == "auto")
+		modes->SelectRotation();
+	else if(cmd == "mode")
+	{
+		for(int i = 0; i < numModes; ++i)
+		{
+			if(value == modeNames[i])
+				modes->Select(static_cast<EMode>(i));
+		}
+	}
+	else if(cmd == "countdown" && sscanf(arg, "%d", &secs) == 1 && secs >= 0)
+		modes->StartCountdown(seconds{ secs }, now);
+	else if(cmd == "stopwatch" && value == "start")
+		modes->GetStopwatch().Start(now);
+	else if(cmd == "stopwatch" && value == "stop")
+		modes->GetStopwatch().Stop(now);
+	else if(cmd == "stopwatch" && value == "reset")
+		modes->GetStopwatch().Reset();
+}
+
+void CContentServer::Put(int priority, int timeoutMs, CScrollText&& text, steady_clock::time_point now)
+{
+	if(priority <= 0 || UINT8_MAX < priority || timeoutMs <= 0)
+		return;
+	auto until = now + milliseconds{ timeoutMs };
+	SOverlay* target = nullptr;
+	for(auto& x : overlays)
+	{
+		if(x.active && x.priority == priority)
+		{
+			target = &x;
+			break;
+		}
+		if(!target && (!x.active || x.until <= now))
+			target = &x;
+	}
+	if(target)
+		*target = SOverlay{ true, static_cast<uint8_t>(priority), now, until, move(text) };
+}
+
+void CContentServer::Remove(int priority)
+{
+	for(auto& x : overlays)
+	{
+		if(x.active && x.priority == priority)
+			x.active = false;
+	}
+}
+
+const SFrame* CContentServer::GetFrame(steady_clock::time_point now) const noexcept
+{
+	const SOverlay* ret = nullptr;
+	for(auto& x : overlays)
+	{
+		if(x.active && now < x.until && (!ret || ret->priority < x.priority))
+			ret = &x;
+	}
+	return ret ? &ret->text.Get(static_cast<size_t>((now - ret->start) / scrollPeriod)) : nullptr;
+}
+
+int CContentServer::GetTimeoutMs(steady_clock::time_point now) const noexcept
+{
+	constexpr int infinite = -1;
+
+	auto ret = infinite;
+	for(auto& x : overlays)
+	{
+		if(!x.active || x.until <= now)
+			continue;
+		auto next = x.until;
+		if(x.text.GetNumSteps() > 1)
+			next = min(next, x.start + ((now - x.start) / scrollPeriod + 1) * scrollPeriod);
+		auto ms = static_cast<int>(duration_cast<milliseconds>(next - now + milliseconds{ 1 } - nanoseconds{ 1 }).count());
+		ret = ret == infinite ? ms : min(ret, ms);
+	}
+	return ret;
+}
+
+bool IsIdle(CLocalTime& localTime, const SIdleSchedule& idle)
+{
+	return idle.IsIdle(localTime.Get(time(nullptr)));
+}
+
+SBrightness GetBrightness(const CDimmer& dimmer, bool isIdle, const SIdleSchedule& idle)
+{
+	return isIdle && idle.mode == IdleDim ? idleBrightness : dimmer.Get();
+}
+
+constexpr auto statsWritePeriod = seconds{ 10 };
+
+void WriteStatsFile(const char* path, const SRefreshStats& stats, uint64_t wakeups)
+{
+	char tmpPath[4096];
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+	auto fp = fopen(tmpPath, "w");
+	if(!fp)
+		return;
+	fprintf(fp, "wakeups %llu\n", static_cast<unsigned long long>(wakeups));
+	stats.Print(fp);
+	if(fclose(fp) == 0)
+		rename(tmpPath, path);
+}
+
+// Exports what the service costs in the Prometheus text format: MMIO stores by kind, CPU time by thread, wakeups and time
+// spent producing the displayed value. Rewritten every statsWritePeriod, like the stats file.
+class CProfiler
+{
+public:
+	explicit CProfiler(const char* path);
+	SStoreCounters& GetStoreCounters() noexcept { return stores; }
+	void AddValueTime(uint64_t ns) noexcept;
+	void Tick(const SRefreshStats* stats, uint64_t wakeups, const pthread_t* refreshThread);
+private:
+	void Write(const SRefreshStats* stats, uint64_t wakeups, const pthread_t* refreshThread, double interval);
+
+	const string path;
+	SStoreCounters stores;
+	uint64_t valueCalls;
+	uint64_t valueNs;
+	steady_clock::time_point lastWrite;
+	uint64_t lastStores[NumTraceKinds];
+	uint64_t lastRefreshes;
+	uint64_t lastWakeups;
+};
+
+static CProfiler* g_profiler = nullptr;
+
+CProfiler::CProfiler(const char* path)
+	: path{ path }
+	, stores{}
+	, valueCalls{ 0 }, valueNs{ 0 }
+	, lastWrite{ steady_clock::now() }
+	, lastStores{}, lastRefreshes{ 0 }, lastWakeups{ 0 }
+{
+}
+
+void CProfiler::AddValueTime(uint64_t ns) noexcept
+{
+	++valueCalls;
+	valueNs += ns;
+}
+
+void CProfiler::Tick(const SRefreshStats* stats, uint64_t wakeups, const pthread_t* refreshThread)
+{
+	auto now = steady_clock::now();
+	if(now < lastWrite + statsWritePeriod)
+		return;
+	Write(stats, wakeups, refreshThread, duration<double>(now - lastWrite).count());
+	lastWrite = now;
+}
+
+double ToSeconds(const timeval& t)
+{
+	return static_cast<double>(t.tv_sec) + static_cast<double>(t.tv_usec) / 1e6;
+}
+
+double GetThreadCpuSeconds(pthread_t th)
+{
+	clockid_t clock;
+	timespec t;
+	if(pthread_getcpuclockid(th, &clock) != 0 || clock_gettime(clock, &t) != 0)
+		return 0;
+	return static_cast<double>(t.tv_sec) + static_cast<double>(t.tv_nsec) / 1e9;
+}
+
+void CProfiler::Write(const SRefreshStats* stats, uint64_t wakeups, const pthread_t* refreshThread, double interval)
+{
+	constexpr const char* kindNames[NumTraceKinds] = { "set", "clear", "function" };
+
+	char tmpPath[4096];
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path.c_str());
+	auto fp = fopen(tmpPath, "w");
+	if(!fp)
+		return;
+
+	uint64_t counts[NumTraceKinds];
+	for(int i = 0; i < NumTraceKinds; ++i)
+		counts[i] = stores.counts[i].load(memory_order_relaxed);
+	fprintf(fp, "# TYPE clock_driver_gpio_stores_total counter\n");
+	for(int i = 0; i < NumTraceKinds; ++i)
+		fprintf(fp, "clock_driver_gpio_stores_total{kind=\"%s\"} %llu\n", kindNames[i], static_cast<unsigned long long>(counts[i]));
+
+	if(stats)
+	{
+		auto refreshes = stats->refreshes.load(memory_order_relaxed);
+		auto frames = static_cast<double>(refreshes - lastRefreshes) / C4Digits::numDigits;
+		fprintf(fp, "# TYPE clock_driver_refreshes_total counter\n");
+		fprintf(fp, "clock_driver_refreshes_total %llu\n", static_cast<unsigned long long>(refreshes));
+		fprintf(fp, "# TYPE clock_driver_gpio_stores_per_frame gauge\n");
+		for(int i = 0; i < NumTraceKinds; ++i)
+			fprintf(fp, "clock_driver_gpio_stores_per_frame{kind=\"%s\"} %.2f\n", kindNames[i], frames > 0 ? static_cast<double>(counts[i] - lastStores[i]) / frames : 0.0);
+		fprintf(fp, "# TYPE clock_driver_wakeups_total counter\n");
+		fprintf(fp, "clock_driver_wakeups_total %llu\n", static_cast<unsigned long long>(wakeups));
+		fprintf(fp, "# TYPE clock_driver_wakeups_per_second gauge\n");
+		fprintf(fp, "clock_driver_wakeups_per_second %.2f\n", static_cast<double>(wakeups - lastWakeups) / interval);
+		lastRefreshes = refreshes;
+		lastWakeups = wakeups;
+	}
+	copy(begin(counts), end(counts), lastStores);
+
+	rusage process, self;
+	getrusage(RUSAGE_SELF, &process);
+	getrusage(RUSAGE_THREAD, &self);
+	fprintf(fp, "# TYPE clock_driver_cpu_seconds_total counter\n");
+	fprintf(fp, "clock_driver_cpu_seconds_total{thread=\"process\",mode=\"user\"} %.6f\n", ToSeconds(process.ru_utime));
+	fprintf(fp, "clock_driver_cpu_seconds_total{thread=\"process\",mode=\"system\"} %.6f\n", ToSeconds(process.ru_stime));
+	fprintf(fp, "clock_driver_cpu_seconds_total{thread=\"main\",mode=\"user\"} %.6f\n", ToSeconds(self.ru_utime));
+	fprintf(fp, "clock_driver_cpu_seconds_total{thread=\"main\",mode=\"system\"} %.6f\n", ToSeconds(self.ru_stime));
+	if(refreshThread && !pthread_equal(*refreshThread, pthread_self()))
+		fprintf(fp, "clock_driver_cpu_seconds_total{thread=\"refresh\",mode=\"all\"} %.6f\n", GetThreadCpuSeconds(*refreshThread));
+	fprintf(fp, "# TYPE clock_driver_context_switches_total counter\n");
+	fprintf(fp, "clock_driver_context_switches_total{thread=\"process\",kind=\"voluntary\"} %ld\n", process.ru_nvcsw);
+	fprintf(fp, "clock_driver_context_switches_total{thread=\"process\",kind=\"involuntary\"} %ld\n", process.ru_nivcsw);
+	fprintf(fp, "clock_driver_context_switches_total{thread=\"main\",kind=\"voluntary\"} %ld\n", self.ru_nvcsw);
+	fprintf(fp, "clock_driver_context_switches_total{thread=\"main\",kind=\"involuntary\"} %ld\n", self.ru_nivcsw);
+
+	fprintf(fp, "# TYPE clock_driver_value_seconds summary\n");
+	fprintf(fp, "clock_driver_value_seconds_sum %.9f\n", static_cast<double>(valueNs) / 1e9);
+	fprintf(fp, "clock_driver_value_seconds_count %llu\n", static_cast<unsigned long long>(valueCalls));
+	if(fclose(fp) == 0)
+		rename(tmpPath, path.c_str());
+}
+
+struct SContent
+{
+	SFrame frame;
+	SBrightness brightness;
+	bool isBlank;
+};
+
+// What the display should show right now; Update runs once per second, Get as often as the engine likes.
+class CContentSource
+{
+public:
+	explicit CContentSource(CLocalTime& localTime, CModeScheduler& modes, const CDimmer& dimmer, const SOptions& options, CContentServer* server);
+	void Update(bool wasClockSet);
+	void Receive(steady_clock::time_point now);
+	int GetTimeoutMs(steady_clock::time_point now) const noexcept;
+	SContent Get(steady_clock::time_point now);
+private:
+	SFrame GetClockFrame();
+
+	CLocalTime& localTime;
+	CModeScheduler& modes;
+	const CDimmer& dimmer;
+	const SOptions& options;
+	CContentServer* const server;
+	CTimeSync sync;
+	bool isIdle;
+	SFrame clockFrame;
+	SBrightness brightness;
+};
+
+CContentSource::CContentSource(CLocalTime& localTime, CModeScheduler& modes, const CDimmer& dimmer, const SOptions& options, CContentServer* server)
+	: localTime{ localTime }, modes{ modes }, dimmer{ dimmer }, options{ options }, server{ server }
+	, sync{}
+	, isIdle{ IsIdle(localTime, options.idle) }
+	, clockFrame{ GetClockFrame() }
+	, brightness{ GetBrightness(dimmer, isIdle, options.idle) }
+{
+}
+
+// Until the clock is synced, the last digit's point blinks along with the colon.
+SFrame CContentSource::GetClockFrame()
+{
+	auto start = g_profiler ? GetRawTime() : 0;
+	auto value = modes.GetValue(localTime, steady_clock::now());
+	if(g_profiler)
+		g_profiler->AddValueTime(GetRawTime() - start);
+	auto ret = EncodeFrame(value);
+	if(!sync.IsSynced() && (time(nullptr) % 2) != 0)
+		ret.segments[C4Digits::numDigits - 1] &= pointMask;
+	return ret;
+}
+
+void CContentSource::Update(bool wasClockSet)
+{
+	sync.Update(wasClockSet);
+	isIdle = IsIdle(localTime, options.idle);
+	clockFrame = GetClockFrame();
+	brightness = GetBrightness(dimmer, isIdle, options.idle);
+}
+
+void CContentSource::Receive(steady_clock::time_point now)
+{
+	if(!server)
+		return;
+	// Mode and countdown commands change the clock frame, and the single engine calls this once per multiplex cycle.
+	if(server->Receive(now))
+		clockFrame = GetClockFrame();
+}
+
+int CContentSource::GetTimeoutMs(steady_clock::time_point now) const noexcept
+{
+	constexpr int infinite = -1;
+
+	return server ? server->GetTimeoutMs(now) : infinite;
+}
+
+SContent CContentSource::Get(steady_clock::time_point now)
+{
+	auto overlay = server ? server->GetFrame(now) : nullptr;
+	modes.GetStopwatch().SetShown(!overlay && modes.Get(now) == ModeStopwatch);
+	return SContent{ overlay ? *overlay : clockFrame, brightness, !overlay && isIdle && options.idle.mode == IdleBlank };
+}
+
+template<class PresentFn, class TickFn>
+void RunContentLoop(CLocalTime& localTime, CModeScheduler& modes, CSecondTimer& timer, const CDimmer& dimmer, const SOptions& options, CContentServer* server, PresentFn&& present, TickFn&& tick)
+{
+	constexpr uint32_t timerEvent = 0b01;
+	constexpr uint32_t contentEvent = 0b10;
+
+	CPoller poller;
+	poller.Add(timer.GetFD(), timerEvent);
+	if(server)
+		poller.Add(server->GetFD(), contentEvent);
+
+	CContentSource source{ localTime, modes, dimmer, options, server };
+	while(!g_finished && !g_reload)
+	{
+		auto now = steady_clock::now();
+		auto content = source.Get(now);
+		present(content.frame, content.brightness, content.isBlank);
+
+		auto events = poller.Wait(source.GetTimeoutMs(now));
+		if(events & timerEvent)
+		{
+			source.Update(timer.Wait());
+			tick();
+		}
+		if(events & contentEvent)
+			source.Receive(steady_clock::now());
+	}
+}
+
+unique_ptr<CContentServer> CreateContentServer(const char* path, CModeScheduler& modes, const CFrameRing* ring)
+{
+	if(!path)
+		return nullptr;
+	auto ret = make_unique<CContentServer>(path);
+	ret->SetModeScheduler(&modes);
+	ret->SetFrameRing(ring);
+	return ret;
+}
+
+void ApplyContentOptions(const SOptions& options, CLocalTime& localTime, CModeScheduler& modes)
+{
+	SetTimeZone(options.timeZone);
+	localTime.Reset();
+	modes.SetRotation(options.modes);
+}
+
+// The port and the display it drives, held together so that a display rebuild can build the next pair before the running one is
+// torn down.
+struct SPipeline
+{
+	unique_ptr<CGPIOPort> port;
+	unique_ptr<CDefaultDisplay> defaultDisplay;
+	unique_ptr<CDisplayGroup> group;
+#if !defined(BOARD_RP1) && !defined(MOCK_GPIO)
+	unique_ptr<CDmaDisplay> dma;
+#endif
+};
+
+// The observer is attached before any display exists, so the pin setup is traced and counted too.
+unique_ptr<SPipeline> BuildPipeline(const SOptions& options, const SStoreObserver& observer)
+{
+	auto ret = make_unique<SPipeline>();
+	ret->port = make_unique<CGPIOPort>(options.gpioDevice, observer);
+#ifdef MOCK_GPIO
+	if(options.benchmark)
+		return ret;
+#endif
+	if(options.chains.empty() && options.dmaChannel == noDmaChannel)
+		ret->defaultDisplay = make_unique<CDefaultDisplay>(*ret->port);
+	else if(options.dmaChannel == noDmaChannel)
+		ret->group = make_unique<CDisplayGroup>(*ret->port, options.chains);
+#if !defined(BOARD_RP1) && !defined(MOCK_GPIO)
+	else
+	{
+		ret->group = make_unique<CDisplayGroup>(*ret->port, GetChains(options));
+		ret->dma = make_unique<CDmaDisplay>(*ret->group, options.dmaChannel, options.refreshPeriod);
+	}
+#endif
+	return ret;
+}
+
+// What outlives thread and display rebuilds. A reload opens everything its configuration needs here before anything running is
+// torn down, so one that cannot be applied leaves the service as it was.
+struct SRuntime
+{
+	unique_ptr<SPipeline> pipeline;
+	unique_ptr<SPipeline> nextPipeline;
+	unique_ptr<CTraceRecorder> recorder;
+	unique_ptr<CTraceRecorder> nextRecorder;
+	bool isTraceChanged;
+	unique_ptr<CDimmer> dimmer;
+	unique_ptr<CContentServer> server;
+	unique_ptr<CFrameRing> ring;
+	SStoreCounters* counters;
+};
+
+// Both run while nothing refreshes the display, so the recorder and the counters keep a single writer.
+SStoreObserver GetObserver(SRuntime& runtime)
+{
+	if(runtime.isTraceChanged)
+	{
+		if(runtime.pipeline)
+			runtime.pipeline->port->SetObserver(SStoreObserver{});
+		runtime.recorder = move(runtime.nextRecorder);
+		runtime.isTraceChanged = false;
+	}
+	return SStoreObserver{ runtime.recorder.get(), runtime.counters };
+}
+
+void AttachPort(SRuntime& runtime)
+{
+	auto observer = GetObserver(runtime);
+	runtime.pipeline->port->SetObserver(observer);
+}
+
+// A capture into the running trace's file is opened under a temporary name and renamed over it, so the running recorder's last
+// writes land in the old, unlinked file.
+unique_ptr<CTraceRecorder> OpenTrace(const SOptions& cur, const SOptions& next)
+{
+	if(!next.tracePath)
+		return nullptr;
+	if(!IsSamePath(cur.tracePath, next.tracePath))
+		return make_unique<CTraceRecorder>(next.tracePath, next.traceDuration);
+	auto tmpPath = string{ next.tracePath } + ".tmp";
+	auto ret = make_unique<CTraceRecorder>(tmpPath.c_str(), next.traceDuration);
+	rename(tmpPath.c_str(), next.tracePath);
+	return ret;
+}
+
+// Calls run, which returns on shutdown or SIGHUP, and applies reloads in place, so overlays, the stopwatch and the display survive.
+// Returns when a reload needs more than that, or RebuildNone on shutdown. Whatever the next configuration needs is opened into
+// runtime before returning, and a display on separate pins is built while the running one keeps refreshing. isRingRead tells
+// whether run's display reads the frame ring, which the content server then hands out.
+template<class RunFn>
+ERebuild RunReloadLoop(unique_ptr<SConfig>& config, SRuntime& runtime, CLocalTime& localTime, CModeScheduler& modes, bool isRingRead, RunFn&& run)
+{
+	ApplyContentOptions(config->options, localTime, modes);
+	if(runtime.server)
+		runtime.server->SetFrameRing(isRingRead ? runtime.ring.get() : nullptr);
+	g_notifier.Notify("READY=1");
+	while(true)
+	{
+		run(*runtime.dimmer, config->options, runtime.server.get());
+		if(g_finished)
+			return RebuildNone;
+		g_reload = 0;
+		g_notifier.Notify("RELOADING=1");
+
+		unique_ptr<SConfig> next;
+		unique_ptr<CDimmer> nextDimmer;
+		unique_ptr<CContentServer> nextServer;
+		unique_ptr<CFrameRing> nextRing;
+		unique_ptr<CTraceRecorder> nextRecorder;
+		unique_ptr<SPipeline> nextPipeline;
+		ERebuild rebuild;
+		bool isServerChanged;
+		bool isTraceChanged;
+		try
+		{
+			next = LoadConfig(config->argc, config->argv);
+			rebuild = GetRebuild(config->options, next->options);
+			nextDimmer = make_unique<CDimmer>(next->options.brightness, next->options.sensorPath, next->options.sensorFull);
+			isServerChanged = !IsSamePath(config->options.contentPath, next->options.contentPath);
+			if(next->options.contentPath && !runtime.ring)
+			{
+				// The refresh loop picks up a new ring only when it restarts.
+				nextRing = make_unique<CFrameRing>();
+				if(isRingRead)
+					rebuild = max(rebuild, RebuildThread);
+			}
+			auto ring = nextRing ? nextRing.get() : runtime.ring.get();
+			if(isServerChanged)
+				nextServer = CreateContentServer(next->options.contentPath, modes, isRingRead ? ring : nullptr);
+			isTraceChanged = IsTraceChanged(config->options, next->options);
+			if(isTraceChanged)
+				nextRecorder = OpenTrace(config->options, next->options);
+#if !defined(BOARD_RP1) && !defined(MOCK_GPIO)
+			if(rebuild != RebuildNone && next->options.dmaChannel != noDmaChannel)
+				ProbeDma();
+#endif
+			if(rebuild == RebuildDisplay)
+			{
+				// A pipeline built alongside the running one would be a second writer to the recorder and the counters.
+				auto isObserved = runtime.counters || (isTraceChanged ? nextRecorder : runtime.recorder);
+				if(CanOverlap(config->options, next->options) && !isObserved)
+					nextPipeline = BuildPipeline(next->options, SStoreObserver{});
+				else
+					CGPIOPort probe{ next->options.gpioDevice, SStoreObserver{} };		// the running display has to go first, so only check the device opens
+			}
+		}
+		catch(...)
+		{
+			printf("reload failed, keeping the running configuration\n");
+			fflush(stdout);
+			g_notifier.Notify("READY=1");
+			continue;
+		}
+		runtime.dimmer = move(nextDimmer);
+		if(isServerChanged)
+			runtime.server = move(nextServer);
+		if(nextRing)
+			runtime.ring = move(nextRing);
+		if(isTraceChanged)
+		{
+			runtime.nextRecorder = move(nextRecorder);
+			runtime.isTraceChanged = true;
+		}
+		runtime.nextPipeline = move(nextPipeline);
+		config = move(next);
+		if(rebuild != RebuildNone)
+			return rebuild;
+		ApplyContentOptions(config->options, localTime, modes);
+		g_notifier.Notify("READY=1");
+	}
+}
+
+// The once-per-second housekeeping shared by both refresh engines.
+class CRefreshTicker
+{
+public:
+	explicit CRefreshTicker();
+	template<class StallFn>
+	void Tick(StallFn&& setStalled, const char* statsPath, const SRefreshStats& stats, uint64_t wakeups, bool isParked, pthread_t refreshThread);
+private:
+	CRefreshWatchdog watchdog;
+	steady_clock::time_point nextStatsWrite;
+};
+
+CRefreshTicker::CRefreshTicker()
+	: watchdog{}, nextStatsWrite{ steady_clock::now() }
+{
+}
+
+// setStalled(true) runs on the tick refreshing is found stalled and setStalled(false) on every tick it is not. It has to leave
+// the port to the thread that refreshes it, so the recorder and the store counters keep a single writer.
+template<class StallFn>
+void CRefreshTicker::Tick(StallFn&& setStalled, const char* statsPath, const SRefreshStats& stats, uint64_t wakeups, bool isParked, pthread_t refreshThread)
+{
+	if(watchdog.Check(stats.refreshes.load(memory_order_relaxed), isParked))
+	{
+		setStalled(true);
+		printf("refresh stalled\n");
+		fflush(stdout);
+	}
+	else if(!watchdog.IsStalled())
+		setStalled(false);
+	if(g_dumpStats)
+	{
+		g_dumpStats = 0;
+		printf("\nwakeups %llu\n", static_cast<unsigned long long>(wakeups));
+		stats.Print(stdout);
+		fflush(stdout);
+	}
+	if(statsPath && nextStatsWrite <= steady_clock::now())
+	{
+		WriteStatsFile(statsPath, stats, wakeups);
+		nextStatsWrite += statsWritePeriod;
+	}
+	if(g_profiler)
+		g_profiler->Tick(&stats, wakeups, &refreshThread);
+}
+
+void PrintWakeupRate(uint64_t wakeups, steady_clock::time_point start)
+{
+	auto elapsed = duration<double>(steady_clock::now() - start).count();
+	if(elapsed > 0)
+		printf("\n%.1f wakeups/s", static_cast<double>(wakeups) / elapsed);
+}
+
+template<class Display>
+ERebuild RunDispThread(Display& display, unique_ptr<SConfig>& config, SRuntime& runtime, CLocalTime& localTime, CModeScheduler& modes, CSecondTimer& timer)
+{
+	CFrameBuffer frames{ EncodeFrame(modes.GetValue(localTime, steady_clock::now())) };
+	CBrightness brightness{ config->options.brightness };
+	while(true)
+	{
+		g_pinTiming.Configure(config->options.pinTiming);
+		AttachPort(runtime);
+		auto sharedValues = SSharedValues<Display>{ display, frames, runtime.ring.get(), modes.GetStopwatch(), brightness, config->options.refreshPeriod, config->options.maxSegments };
+		CDispThread th{ &sharedValues, config->options.realTime };
+		auto start = steady_clock::now();
+		CRefreshTicker ticker;
+		auto present = [&frames, &brightness, &th] (const SFrame& frame, const SBrightness& curBrightness, bool isBlank)
 		{
-			value = GetMyValue();
-			this_thread::sleep_for(milliseconds { 100 });
+			frames.Publish(frame);
+			brightness.Store(curBrightness);
+			th.SetParked(isBlank);
+		};
+		auto tick = [&config, &th, &ticker] ()
+		{
+			// Without a watchdog nothing restarts us, so a stalled thread is only asked to blank until it refreshes again. With one,
+			// it is stopped and blanks the digits on its way out while systemd comes for the rest.
+			auto setStalled = [&th] (bool isStalled)
+			{
+				if(isStalled && g_notifier.HasWatchdog())
+					th.Stop();
+				else
+					th.RequestBlank(isStalled);
+			};
+			ticker.Tick(setStalled, config->options.statsPath, th.GetStats(), th.GetWakeups(), th.IsParked(), th.GetNativeHandle());
+		};
+		auto rebuild = RunReloadLoop(config, runtime, localTime, modes, true,
+			[&localTime, &modes, &timer, &present, &tick] (const CDimmer& dimmer, const SOptions& options, CContentServer* server)
+			{
+				RunContentLoop(localTime, modes, timer, dimmer, options, server, present, tick);
+			});
+		if(rebuild != RebuildThread)
+		{
+			if(rebuild == RebuildNone)
+				PrintWakeupRate(th.GetWakeups(), start);
+			return rebuild;
+		}
+	}
+}
+
+steady_clock::time_point GetNextSecond()
+{
+	auto wall = system_clock::now();
+	return steady_clock::now() + (floor<seconds>(wall) + seconds{ 1 } - wall);
+}
+
+// Refresh and content share the calling thread. Per-second work rides on the multiplex cycle that crosses the second, the
+// content socket is drained by one non-blocking recv per cycle, and while parked the thread only wakes on the second.
+template<class Display>
+ERebuild RunSingleThreaded(Display& display, unique_ptr<SConfig>& config, SRuntime& runtime, CLocalTime& localTime, CModeScheduler& modes)
+{
+	CFrameBuffer frames{ EncodeFrame(modes.GetValue(localTime, steady_clock::now())) };
+	CBrightness brightness{ config->options.brightness };
+	while(true)
+	{
+		g_pinTiming.Configure(config->options.pinTiming);
+		AttachPort(runtime);
+		CSavedScheduling savedScheduling{ pthread_self() };
+		SetRealTime(pthread_self(), config->options.realTime);
+		SRefreshStats stats;
+		CRefreshTicker ticker;
+		uint64_t wakeups = 0;
+		auto start = steady_clock::now();
+		auto rebuild = RunReloadLoop(config, runtime, localTime, modes, true,
+			[&] (const CDimmer& dimmer, const SOptions& options, CContentServer* server)
+			{
+				auto sharedValues = SSharedValues<Display>{ display, frames, runtime.ring.get(), modes.GetStopwatch(), brightness, options.refreshPeriod, options.maxSegments };
+				CRefreshControl control;
+				CContentSource source{ localTime, modes, dimmer, options, server };
+				auto nextTick = GetNextSecond();
+				auto update = [&] ()
+				{
+					if(g_finished || g_reload)
+					{
+						control.Finish();
+						return;
+					}
+					auto now = steady_clock::now();
+					if(nextTick <= now)
+					{
+						source.Update(false);
+						ticker.Tick([&display] (bool isStalled) { if(isStalled) display.Blank(); }, options.statsPath, stats, wakeups + control.GetWakeups(), control.IsParked(), pthread_self());
+						nextTick = GetNextSecond();
+					}
+					source.Receive(now);
+					auto content = source.Get(now);
+					frames.Publish(content.frame);
+					brightness.Store(content.brightness);
+					control.SetParked(content.isBlank);
+				};
+				update();
+				RunRefreshLoop(control, stats, sharedValues, update,
+					[&control, &nextTick, &update] ()
+					{
+						while(control.IsParked())
+						{
+							SleepUntil(nextTick);
+							control.CountWakeup();
+							update();
+						}
+					});
+				wakeups += control.GetWakeups();
+			});
+		if(rebuild != RebuildThread)
+		{
+			if(rebuild == RebuildNone)
+				PrintWakeupRate(wakeups, start);
+			return rebuild;
+		}
+	}
+}
+
+#ifdef MOCK_GPIO
+static atomic<uint64_t> g_numAllocations{ 0 };
+
+[[gnu::noinline]] void* operator new(size_t size)
+{
+	g_numAllocations.fetch_add(1, memory_order_relaxed);
+	if(auto p = malloc(size ? size : 1))
+		return p;
+	throw bad_alloc{};
+}
+
+[[gnu::noinline]] void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+[[gnu::noinline]] void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+class CWaveformDecoder
+{
+public:
+	struct SLatch
+	{
+		int chainIdx;
+		uint32_t bits;
+		bool ghost;
+	};
+
+	static constexpr int noDigit = -1;
+	static constexpr int manyDigits = -2;
+
+	explicit CWaveformDecoder(const vector<SChainPins>& chains);
+	void Apply(const CMockPort::SStore& store);
+	int GetActiveDigit(int chainIdx) const noexcept;
+	const vector<SLatch>& GetLatches() const noexcept { return latches; }
+private:
+	static bool IsHigh(uint64_t levels, int id) noexcept { return id != noPin && ((levels >> id) & 0b1); }
+
+	const vector<SChainPins> chains;
+	vector<uint32_t> shifted;
+	vector<SLatch> latches;
+	uint64_t levels;
+};
+
+CWaveformDecoder::CWaveformDecoder(const vector<SChainPins>& chains)
+	: chains{ chains }, shifted(chains.size(), 0), levels{ 0 }
+{
+	latches.reserve(256);
+}
+
+void CWaveformDecoder::Apply(const CMockPort::SStore& store)
+{
+	auto pins = static_cast<uint64_t>(store.value) << SBoard::bankStarts[store.bank];
+	auto last = levels;
+	levels = store.kind == GPIOSet ? (levels | pins) : (levels & ~pins);
+	for(size_t i = 0; i < chains.size(); ++i)
+	{
+		auto& x = chains[i];
+		if(!IsHigh(last, x.sckID) && IsHigh(levels, x.sckID))
+			shifted[i] = (shifted[i] << 1) | (IsHigh(last, x.siID) ? 1 : 0);
+		if(!IsHigh(last, x.rckID) && IsHigh(levels, x.rckID))
+		{
+			auto ghost = false;
+			for(auto id : x.digitIDs)
+				ghost = ghost || IsHigh(levels, id);
+			latches.push_back(SLatch{ static_cast<int>(i), shifted[i], ghost });
+		}
+	}
+}
+
+int CWaveformDecoder::GetActiveDigit(int chainIdx) const noexcept
+{
+	auto ret = noDigit;
+	auto& ids = chains[chainIdx].digitIDs;
+	for(int i = 0; i < C4Digits::numDigits; ++i)
+	{
+		if(!IsHigh(levels, ids[i]))
+			continue;
+		if(ret != noDigit)
+			return manyDigits;
+		ret = i;
+	}
+	return ret;
+}
+
+uint32_t ShiftIn(uint32_t bits, uint8_t value)
+{
+	for(int i = 0; i < 8; ++i)
+		bits = (bits << 1) | ((value >> i) & 0b1);
+	return bits;
+}
+
+struct GoldenTraceMismatch {};
+
+template<class Display>
+void CheckGoldenTrace(Display& display, CMockPort& port, const vector<SChainPins>& chains)
+{
+	constexpr int numCycles = 2;
+	constexpr SMyValue values[numCycles] = { { 0x1234, true }, { 0x5678, false } };
+	constexpr int numDigits = C4Digits::numDigits;
+
+	auto frameLength = 1;
+	for(auto& x : chains)
+		frameLength = max(frameLength, HasCascadedDigitSelect(x) ? 2 : 1);
+
+	CWaveformDecoder decoder{ chains };
+	size_t numLatches = 0;
+	for(int cycle = 0; cycle < numCycles; ++cycle)
+	{
+		auto frame = EncodeFrame(values[cycle]);
+		for(int digitIdx = 0; digitIdx < numDigits; ++digitIdx)
+		{
+			port.StartTrace(1024);
+			display.Switch([&frame] (int, int curDigitIdx) { return frame.segments[curDigitIdx]; });
+			for(auto& x : port.StopTrace())
+				decoder.Apply(x);
+
+			auto& latches = decoder.GetLatches();
+			for(size_t i = 0; i < chains.size(); ++i)
+			{
+				if(numLatches >= latches.size())
+					throw GoldenTraceMismatch{};
+				auto& latch = latches[numLatches++];
+				auto cascaded = HasCascadedDigitSelect(chains[i]);
+				auto chainBits = (cascaded ? 2 : 1) * 8;
+				auto expected = ShiftIn(0, 0b11111111);
+				if(frameLength == 2)
+					expected = ShiftIn(0, cascaded ? GetDigitSelectBits(digitIdx) : 0b11111111);
+				expected = ShiftIn(expected, frame.segments[digitIdx]);
+				auto mask = chainBits == 32 ? ~0u : (1u << chainBits) - 1;
+				if(latch.chainIdx != static_cast<int>(i) || latch.ghost || (latch.bits & mask) != (expected & mask))
+					throw GoldenTraceMismatch{};
+				if(!cascaded && decoder.GetActiveDigit(static_cast<int>(i)) != digitIdx)
+					throw GoldenTraceMismatch{};
+			}
+			if(numLatches != latches.size())
+				throw GoldenTraceMismatch{};
+		}
+	}
+}
+
+template<class Display>
+void RunBenchmark(const char* name, Display& display, CMockPort& port, const vector<SChainPins>& chains)
+{
+	constexpr int numRefreshes = 1000000;
+	constexpr int numDigits = C4Digits::numDigits;
+
+	CheckGoldenTrace(display, port, chains);
+
+	auto frame = EncodeFrame(SMyValue{ 0x1234, true });
+	auto write = [&frame] (int, int curDigitIdx) { return frame.segments[curDigitIdx]; };
+	auto stores = port.GetNumStores();
+	auto allocations = g_numAllocations.load(memory_order_relaxed);
+	auto start = GetRawTime();
+	for(int i = 0; i < numRefreshes; ++i)
+		display.Switch(write);
+	auto elapsed = GetRawTime() - start;
+	stores = port.GetNumStores() - stores;
+	allocations = g_numAllocations.load(memory_order_relaxed) - allocations;
+
+	auto numFrames = static_cast<double>(numRefreshes / numDigits);
+	printf("%-16s golden ok, %6.1f ns/refresh, %5.1f stores/frame, %.2f allocations/frame\n",
+		name,
+		static_cast<double>(elapsed) / numRefreshes,
+		static_cast<double>(stores) / numFrames,
+		static_cast<double>(allocations) / numFrames);
+}
+
+void RunDispThreadBenchmark(CMockPort& port)
+{
+	constexpr auto duration = milliseconds{ 500 };
+
+	CDefaultDisplay display{ port };
+	CFrameBuffer frames{ EncodeFrame(SMyValue{ 0x1234, true }) };
+	CBrightness brightness{ fullBrightness };
+	CStopwatch stopwatch;
+	auto sharedValues = SSharedValues<CDefaultDisplay>{ display, frames, nullptr, stopwatch, brightness, minRefreshPeriod, noCurrentLimit };
+	auto allocations = g_numAllocations.load(memory_order_relaxed);
+	{
+		CDispThread th{ &sharedValues, defaultRealTimeConfig };
+		this_thread::sleep_for(duration);
+		th.GetStats().Print(stdout);
+	}
+	printf("disp thread allocations %llu\n", static_cast<unsigned long long>(g_numAllocations.load(memory_order_relaxed) - allocations));
+}
+
+void RunBenchmarks(CMockPort& port)
+{
+	{
+		CDefaultDisplay display{ port };
+		RunBenchmark("static", display, port, { defaultChainPins });
+	}
+	{
+		vector<SChainPins> chains{ defaultChainPins };
+		CDisplayGroup group{ port, chains };
+		RunBenchmark("group", group, port, chains);
+	}
+	{
+		auto parallel = defaultChainPins;
+		parallel.siID = 12;
+		vector<SChainPins> chains{ defaultChainPins, parallel };
+		CDisplayGroup group{ port, chains };
+		RunBenchmark("group parallel", group, port, chains);
+	}
+	{
+		vector<SChainPins> chains{ { defaultChainPins.siID, defaultChainPins.rckID, defaultChainPins.sckID, { noPin, noPin, noPin, noPin } } };
+		CDisplayGroup group{ port, chains };
+		RunBenchmark("group cascaded", group, port, chains);
+	}
+	RunDispThreadBenchmark(port);
+}
+#endif
+
+int main(int argc, char* argv[])
+{
+	try
+	{
+		auto config = LoadConfig(argc, argv);
+		SetSigHandler(SIGINT);
+		SetSigHandler(SIGTERM);
+		SetSigHandler(SIGUSR1, DumpSigHandler);
+		SetSigHandler(SIGHUP, ReloadSigHandler);
+		SetTimeZone(config->options.timeZone);
+
+		unique_ptr<CProfiler> profiler;
+		if(config->options.profilePath)
+			profiler = make_unique<CProfiler>(config->options.profilePath);
+		g_profiler = profiler.get();
+
+		CLocalTime localTime;
+		CModeScheduler modes{ config->options.modes };
+		CSecondTimer timer;
+		SRuntime runtime{ nullptr, nullptr, nullptr, nullptr, false, nullptr, nullptr, nullptr, profiler ? &profiler->GetStoreCounters() : nullptr };
+		if(config->options.tracePath)
+			runtime.recorder = make_unique<CTraceRecorder>(config->options.tracePath, config->options.traceDuration);
+		runtime.dimmer = make_unique<CDimmer>(config->options.brightness, config->options.sensorPath, config->options.sensorFull);
+		if(config->options.contentPath)
+			runtime.ring = make_unique<CFrameRing>();
+		runtime.server = CreateContentServer(config->options.contentPath, modes, nullptr);
+		auto rebuild = RebuildDisplay;
+		while(rebuild != RebuildNone)
+		{
+			auto& options = config->options;
+			g_pinTiming.Configure(options.pinTiming);
+			if(rebuild != RebuildDisplay)
+			{
+#if !defined(BOARD_RP1) && !defined(MOCK_GPIO)
+				// The port and the chains stay; only the DMA display takes the new refresh period.
+				auto& pipeline = *runtime.pipeline;
+				if(pipeline.dma)
+				{
+					pipeline.dma.reset();
+					pipeline.dma = make_unique<CDmaDisplay>(*pipeline.group, options.dmaChannel, options.refreshPeriod);
+				}
+#endif
+			}
+			else if(runtime.nextPipeline)
+				runtime.pipeline = move(runtime.nextPipeline);
+			else
+			{
+				runtime.pipeline.reset();
+				runtime.pipeline = BuildPipeline(options, GetObserver(runtime));
+			}
+			auto& pipeline = *runtime.pipeline;
+#ifdef MOCK_GPIO
+			if(options.benchmark)
+			{
+				AttachPort(runtime);
+				RunBenchmarks(*pipeline.port);
+				rebuild = RebuildNone;
+			}
+			else
+#endif
+			if(pipeline.defaultDisplay)
+			{
+				auto& display = *pipeline.defaultDisplay;
+				rebuild = options.engine == EngineSingle ? RunSingleThreaded(display, config, runtime, localTime, modes) : RunDispThread(display, config, runtime, localTime, modes, timer);
+			}
+#if !defined(BOARD_RP1) && !defined(MOCK_GPIO)
+			else if(pipeline.dma)
+			{
+				AttachPort(runtime);
+				auto& group = *pipeline.group;
+				auto& dma = *pipeline.dma;
+				auto present = [&dma, &group, &config] (const SFrame& frame, const SBrightness& brightness, bool isBlank)
+				{
+					auto& shown = isBlank ? blankFrame : frame;
+					dma.Update([&shown] (int, int digitIdx) { return shown.segments[digitIdx]; },
+						BalanceBrightness(brightness, shown, config->options.maxSegments, group.GetNumChains()));
+				};
+				auto tick = [] ()
+				{
+					if(g_notifier.HasWatchdog())
+						g_notifier.Notify("WATCHDOG=1");
+					if(g_profiler)
+						g_profiler->Tick(nullptr, 0, nullptr);
+				};
+				rebuild = RunReloadLoop(config, runtime, localTime, modes, false,
+					[&localTime, &modes, &timer, &present, &tick] (const CDimmer& dimmer, const SOptions& options, CContentServer* server)
+					{
+						RunContentLoop(localTime, modes, timer, dimmer, options, server, present, tick);
+					});
+			}
+#endif
+			else
+			{
+				auto& group = *pipeline.group;
+				rebuild = options.engine == EngineSingle ? RunSingleThreaded(group, config, runtime, localTime, modes) : RunDispThread(group, config, runtime, localTime, modes, timer);
+			}
 		}
+		g_notifier.Notify("STOPPING=1");
 	}
 	catch(...)
 	{
 		try { throw; }
+		catch(InvalidOption)
+		{
+			printf("usage: %s [-r] [-p priority] [-a cpu] [-g gpio-device] [-D dma-channel] [-b duty[,d2,d3,d4]] [-l sensor-path,full] [-f refresh-us] [-o hh:mm-hh:mm] [-m blank|dim] [-S stats-file] [-t vcd-file[,seconds]] [-w high-ns,low-ns,setup-ns] [-k blank-ns] [-c content-socket] [-M mode[:seconds],...] [-z time-zone] [-C config-file] [-e threads|single] [-P profile-file] [-E max-segments] [-d si,rck,sck[,d1,d2,d3,d4]]...\n", argv[0]);
+		}
 		catch(CMemFile::OpenError)
 		{
 			printf("open error\n");
 		}
+#ifdef USE_GPIOD
+		catch(CGpiodPort::OpenError)
+		{
+			printf("gpiochip open error\n");
+		}
+		catch(CGpiodPort::RequestError)
+		{
+			printf("gpio line request error\n");
+		}
+#endif
+		catch(CSecondTimer::CreateError)
+		{
+			printf("timer error\n");
+		}
+		catch(CContentServer::OpenError)
+		{
+			printf("content socket error\n");
+		}
+		catch(CFrameRing::CreateError)
+		{
+			printf("frame ring error\n");
+		}
+		catch(CPoller::CreateError)
+		{
+			printf("epoll error\n");
+		}
+		catch(ConfigError)
+		{
+			printf("config file open error\n");
+		}
+		catch(CTraceRecorder::OpenError)
+		{
+			printf("trace file open error\n");
+		}
+		catch(CDimmer::SensorError)
+		{
+			printf("ambient sensor open error\n");
+		}
+#ifdef MOCK_GPIO
+		catch(GoldenTraceMismatch)
+		{
+			printf("golden trace mismatch\n");
+		}
+#endif
+#if !defined(BOARD_RP1) && !defined(MOCK_GPIO)
+		catch(CMailbox::OpenError)
+		{
+			printf("mailbox open error\n");
+		}
+		catch(CMailbox::CallError)
+		{
+			printf("mailbox call error\n");
+		}
+		catch(CDmaMemory::AllocError)
+		{
+			printf("dma memory error\n");
+		}
+		catch(CDmaDisplay::BankError)
+		{
+			printf("dma output supports GPIO 0-31 only\n");
+		}
+#endif
 		catch(...)
 		{
 			printf("unknown error\n");